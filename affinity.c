@@ -0,0 +1,113 @@
+// Needed for CPU affinity (sched_getaffinity and pthread_setaffinity_np).
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+
+int allowed_cpu(int index) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0) {
+        return -1;
+    }
+
+    index %= CPU_COUNT(&set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && index-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+void pin_to_cpu(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int nodes = 1;
+static int node_of_cpu[CPU_SETSIZE];
+
+// Marks every CPU in a list such as "0-3,8-11" as belonging to node.
+static void read_cpulist(const char *file_name, int node) {
+    FILE *f = fopen(file_name, "r");
+    if (f == NULL) {
+        return;
+    }
+
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0) {
+                node_of_cpu[cpu] = node;
+            }
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+}
+
+static void read_topology(void) {
+    memset(node_of_cpu, 0, sizeof(node_of_cpu));
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return;
+    }
+
+    // The node directories are not necessarily numbered without gaps.
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        if (strncmp(entry->d_name, "node", 4) != 0) {
+            continue;
+        }
+        strtol(entry->d_name + 4, &end, 10);
+        if (end == entry->d_name + 4 || *end != '\0') {
+            continue;
+        }
+
+        char file_name[64 + sizeof(entry->d_name)];
+        snprintf(file_name, sizeof(file_name), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        read_cpulist(file_name, count++);
+    }
+    closedir(dir);
+
+    nodes = count > 0 ? count : 1;
+}
+
+int num_numa_nodes(void) {
+    pthread_once(&topology_once, read_topology);
+    return nodes;
+}
+
+int cpu_node(int cpu) {
+    pthread_once(&topology_once, read_topology);
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return 0;
+    }
+    return node_of_cpu[cpu];
+}
@@ -0,0 +1,23 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+// Helpers to pin threads to CPUs. Pinning is best effort: if the system does
+// not allow it, threads simply keep running wherever the scheduler puts them.
+
+// Returns the index-th CPU that the process is allowed to run on (wrapping
+// around if there are fewer CPUs than index), or -1 if that is unknown.
+int allowed_cpu(int index);
+
+// Pins the calling thread to a single CPU (ignored if cpu is negative).
+void pin_to_cpu(int cpu);
+
+// The NUMA topology, as read from /sys/devices/system/node. Nodes are numbered
+// densely from 0. If the topology cannot be read, everything is on node 0.
+
+// Returns the number of NUMA nodes.
+int num_numa_nodes(void);
+
+// Returns the node of a CPU (0 if cpu is negative or unknown).
+int cpu_node(int cpu);
+
+#endif
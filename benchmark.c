@@ -1,17 +1,54 @@
+// Needed for fork, mmap with MAP_ANONYMOUS, waitpid, sigaction and readdir.
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Include OpenMP
+#include <omp.h>
 
+#include "affinity.h"
+#include "cifar.h"
+#include "latency.h"
+#include "memtrack.h"
 #include "network.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "server.h"
+#include "session.h"
+#include "trace.h"
+#include "validate.h"
 #include "volume.h"
 
-// Place where test data is stored on instructional machines.
-const char *DATA_FOLDER = "/home/ff/cs61c/proj4/cifar-10-batches-bin";
 const int DEFAULT_BENCHMARK_SIZE = 1200;
 const int PARTEST_SIZE = 1000;
+const int STREAM_WINDOW = 256;
+const int SESSION_REQUEST_SIZE = 4;
+const int INTERACTIVE_SIZE = 100;
+const int ADAPTIVE_MAX_REQUEST = 64;
+const char *SOCKET_PATH = "/tmp/cnn_benchmark.sock";
+const int SERVER_MAX_BATCH = 16;
+const int SERVER_MAX_WAIT_US = 1000;
+const int LOAD_CLIENTS = 8;
+const int LOAD_REQUESTS = 100;
+const int SCALING_REPEATS = 3;
+const int LATENCY_WARMUP_SIZE = 100;
+const int VERIFY_MAX_FILES = 256;
+
+// Set from the RESULT_CACHE_MB environment variable, NULL if not set.
+result_cache_t *result_cache = NULL;
 
 // Function to dump the content of a volume for comparison.
 void dump_volume(volume_t* v) {
@@ -28,75 +65,27 @@ void dump_volume(volume_t* v) {
 
 // Load the snapshot of the CNN we are going to run.
 network_t *load_cnn_snapshot() {
+    uint64_t trace_start = trace_now();
     network_t *net = make_network();
     conv_load(net->l0, "./snapshot/layer1_conv.txt");
     conv_load(net->l3, "./snapshot/layer4_conv.txt");
     conv_load(net->l6, "./snapshot/layer7_conv.txt");
     fc_load(net->l9, "./snapshot/layer10_fc.txt");
+    trace_record("load_snapshot", "io", trace_start, 0);
     return net;
 }
 
-// Load an image from the cifar10 data set.
-void load_sample(volume_t *v, int sample_num) {
-    printf("Loading input sample %d...\n", sample_num);
-
-    int batch = sample_num / 10000;
-    int ix = sample_num % 10000;
-
-    char file_name[1024];
-    sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
-
-    FILE *fin = fopen(file_name, "rb");
-    assert(fin != NULL);
-
-    fseek(fin, ix * 3073, SEEK_SET);
-
-    uint8_t data[3073];
-    assert(fread(data, 1, 3073, fin) == 3073);
-
-    int outp = 1;
-    for (int d = 0; d < 3; d++) {
-        for (int y = 0; y < 32; y++) {
-            for (int x = 0; x < 32; x++) {
-                volume_set(v, x, y, d, ((double)data[outp++])/255.0-0.5);
-            }
-        }
-    }
-
-    fclose(fin);
-}
-
-// Load an entire batch of images from the cifar10 data set (which is divided
-// into 5 batches with 10,000 images each).
-batch_t load_batch(int batch) {
-    printf("Loading input batch %d...\n", batch);
-
-    char file_name[1024];
-    sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
-
-    FILE *fin = fopen(file_name, "rb");
-    assert(fin != NULL);
-    batch_t batchdata = malloc(sizeof(volume_t *) * 10000);
-
-    for (int i = 0; i < 10000; i++) {
-        batchdata[i] = make_volume(32, 32, 3, 0.0);
-
-        uint8_t data[3073];
-        assert(fread(data, 1, 3073, fin) == 3073);
-
-        int outp = 1;
-        for (int d = 0; d < 3; d++) {
-            for (int y = 0; y < 32; y++) {
-                for (int x = 0; x < 32; x++) {
-                    volume_set(batchdata[i], x, y, d, ((double)data[outp++])/255.0-0.5);
-                }
-            }
+// Returns the class with the highest likelihood.
+int best_class(double *likelihoods) {
+    int best_class = -1;
+    double max_likelihood = -INFINITY;
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        if (max_likelihood < likelihoods[c]) {
+            max_likelihood = likelihoods[c];
+            best_class = c;
         }
     }
-
-    fclose(fin);
-
-    return batchdata;
+    return best_class;
 }
 
 // Computes the accuracy of our neural network by comparing our predicted values
@@ -104,18 +93,22 @@ batch_t load_batch(int batch) {
 double get_accuracy(int *samples, int *predictions, int n) {
     int num_correct = 0;
 
-    char file_name[1024];
-
-    // Open all data batch files.
-    FILE *batch_files[5];
-    for (int i = 0; i < 5; i++) {
-        sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, i + 1);
-        batch_files[i] = fopen(file_name, "rb");
+    // Open the data batch files as they are needed (a synthetic data set can
+    // have more than the 5 of cifar10).
+    FILE *batch_files[MAX_BATCHES];
+    for (int i = 0; i < MAX_BATCHES; i++) {
+        batch_files[i] = NULL;
     }
 
     for (int i = 0; i < n; i++) {
-        int batch = samples[i] / 10000;
+        int batch = sample_batch(samples[i]);
         int index = samples[i] % 10000;
+        if (batch_files[batch] == NULL) {
+            char file_name[1024];
+            sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, batch + 1);
+            batch_files[batch] = fopen(file_name, "rb");
+            assert(batch_files[batch] != NULL);
+        }
         fseek(batch_files[batch], index * 3073, SEEK_SET);
         char label;
         fread(&label, 1, 1, batch_files[batch]);
@@ -125,26 +118,26 @@ double get_accuracy(int *samples, int *predictions, int n) {
     }
 
     // Close all data batch files.
-    for (int i = 0; i < 5; i++) {
-        fclose(batch_files[i]);
+    for (int i = 0; i < MAX_BATCHES; i++) {
+        if (batch_files[i] != NULL) {
+            fclose(batch_files[i]);
+        }
     }
 
     return ((double) num_correct) / n;
 }
 
-// Perform the classification (this calls into the functions from network.c)
-void run_classification(int *samples, int n, double ***keep_likelihoods) {
-    printf("Making network...\n");
-    network_t *net = load_cnn_snapshot();
-
-    batch_t batches[50];
-    for (int i = 0; i < 50; i++) {
+// Loads the data set batches that contain the given samples into batches
+// (which has room for MAX_BATCHES batches) and returns an array with the input
+// volume of every sample.
+volume_t **load_inputs(int *samples, int n, batch_t *batches) {
+    for (int i = 0; i < MAX_BATCHES; i++) {
         batches[i] = NULL;
     }
 
     printf("Loading batches...\n");
     for (int i = 0; i < n; i++) {
-        int batch = samples[i] / 10000;
+        int batch = sample_batch(samples[i]);
         if (batches[batch] == NULL) {
             batches[batch] = load_batch(batch);
         }
@@ -152,52 +145,96 @@ void run_classification(int *samples, int n, double ***keep_likelihoods) {
 
     volume_t **input = (volume_t **) malloc(sizeof(volume_t*)*n);
     for (int i = 0; i < n; i++) {
-        input[i] = batches[samples[i] / 10000][samples[i] % 10000];
+        input[i] = batches[sample_batch(samples[i])][samples[i] % 10000];
     }
+    return input;
+}
 
-    double **likelihoods = (double **) malloc(sizeof(double *) * n);
-    for (int c = 0; c < n; c++) {
-        likelihoods[c] = (double *) malloc(sizeof(double) * NUM_CLASSES);
+// Frees the batches loaded by load_inputs.
+void free_batches(batch_t *batches) {
+    for (int i = 0; i < MAX_BATCHES; i++) {
+        if (batches[i] != NULL) {
+            for (int j = 0; j < 10000; j++) {
+                free_volume(batches[i][j]);
+            }
+            free(batches[i]);
+        }
+    }
+}
+
+// Returns the current time in microseconds.
+uint64_t now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000L * tv.tv_sec + tv.tv_usec;
+}
+
+// Perform the classification (this calls into the functions from network.c).
+// If keep_likelihoods is given, the n x NUM_CLASSES likelihoods are returned
+// through it (to be freed with mem_free). Otherwise, only the most likely
+// class of every image is kept.
+void run_classification(int *samples, int n, double **keep_likelihoods) {
+    uint64_t start = now_us();
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+    uint64_t network_us = now_us();
+
+    batch_t batches[MAX_BATCHES];
+    volume_t **input = load_inputs(samples, n, batches);
+    uint64_t dataset_us = now_us();
+
+    int *predictions = (int *) mem_alloc(sizeof(int) * n, MEM_RESULTS);
+
+    net_output_t out;
+    if (keep_likelihoods == NULL) {
+        out.mode = NET_OUTPUT_TOP_K;
+        out.k = 1;
+        out.classes = predictions;
+        out.scores = (double *) mem_alloc(sizeof(double) * n, MEM_RESULTS);
+    } else {
+        out.mode = NET_OUTPUT_DOUBLE;
+        out.likelihoods = (double *) mem_alloc(sizeof(double) * n * NUM_CLASSES, MEM_RESULTS);
     }
 
     printf("Running classification...\n");
-    net_classify(net, input, likelihoods, n);
+    net_classify_output(net, input, &out, n);
+    uint64_t classify_us = now_us();
 
-    int predictions[n];
-    for (int i = 0; i < n; i++) {
-        int best_class = -1;
-        double max_likelihood = -INFINITY;
-        for (int c = 0; c < NUM_CLASSES; c++) {
-            if (max_likelihood < likelihoods[i][c]) {
-                max_likelihood = likelihoods[i][c];
-                best_class = c;
-            }
+    if (keep_likelihoods != NULL) {
+        for (int i = 0; i < n; i++) {
+            predictions[i] = best_class(out.likelihoods + i * NUM_CLASSES);
         }
-        predictions[i] = best_class;
     }
 
     printf("%lf%% accuracy\n", 100 * get_accuracy(samples, predictions, n));
+    uint64_t scoring_us = now_us();
+
+    if (profile_enabled) {
+        printf("Network load: %ld microseconds\n", network_us - start);
+        printf("Dataset load: %ld microseconds\n", dataset_us - network_us);
+        printf("Classification: %ld microseconds\n", classify_us - dataset_us);
+        printf("Scoring: %ld microseconds\n", scoring_us - classify_us);
+        profile_report(net);
+    }
+
+    if (result_cache != NULL) {
+        printf("Result cache: %ld hits, %ld misses (%zu bytes)\n", result_cache->hits, result_cache->misses,
+               result_cache->bytes);
+    }
+
+    mem_report();
 
     free_network(net);
     free(input);
-
-    for (int i = 0; i < 50; i++) {
-        if (batches[i] != NULL) {
-            for (int j = 0; j < 10000; j++) {
-                free_volume(batches[i][j]);
-            }
-            free(batches[i]);
-        }
-    }
+    free_batches(batches);
 
     if (keep_likelihoods == NULL) {
-        for (int i = 0; i < n; i++) {
-            free(likelihoods[i]);
-        }
-        free(likelihoods);
+        mem_free(out.scores);
     } else {
-        *keep_likelihoods = likelihoods;
+        *keep_likelihoods = out.likelihoods;
     }
+    mem_free(predictions);
 }
 
 // Run benchmark on a specified number samples (if there is none, then
@@ -229,6 +266,392 @@ void do_benchmark(int argc, char **argv) {
     free(samples);
 }
 
+// A stream of consecutive samples from the cifar10 data set, read from the
+// data files one record at a time. The stream wraps around after the last
+// batch, so it can be longer than the data set itself.
+typedef struct sample_stream {
+    FILE *fin;
+    int next;
+    int n;
+    int window;
+    uint8_t *labels;
+    int num_correct;
+} sample_stream_t;
+
+// Source for net_classify_stream: reads the next sample of the stream.
+int read_sample(void *ctx, volume_t *input) {
+    sample_stream_t *s = (sample_stream_t *) ctx;
+    if (s->next == s->n) {
+        return 0;
+    }
+
+    if (s->next % 10000 == 0) {
+        if (s->fin != NULL) {
+            fclose(s->fin);
+        }
+        char file_name[1024];
+        sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, sample_batch(s->next) + 1);
+        s->fin = fopen(file_name, "rb");
+        assert(s->fin != NULL);
+    }
+
+    uint8_t data[3073];
+    assert(fread(data, 1, 3073, s->fin) == 3073);
+    decode_sample(input, data);
+
+    // At most window samples are in flight, so their labels fit in a ring.
+    s->labels[s->next % s->window] = data[0];
+    s->next++;
+    return 1;
+}
+
+// Sink for net_classify_stream: scores the prediction for one sample.
+void score_sample(void *ctx, long index, double *likelihoods) {
+    sample_stream_t *s = (sample_stream_t *) ctx;
+    if (best_class(likelihoods) == s->labels[index % s->window]) {
+        s->num_correct++;
+    }
+}
+
+// Classify a stream of samples (DEFAULT_BENCHMARK_SIZE if not specified) with
+// a bounded number of images in memory, optionally with a different window.
+void do_stream(int argc, char **argv) {
+    int num_samples = DEFAULT_BENCHMARK_SIZE;
+    int window = STREAM_WINDOW;
+    if (argc > 0)
+        num_samples = atoi(argv[0]);
+    if (argc > 1)
+        window = atoi(argv[1]);
+
+    assert(num_samples >= 0 && window > 0);
+
+    printf("STREAMING %d PICTURES WITH A WINDOW OF %d...\n", num_samples, window);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    sample_stream_t stream;
+    stream.fin = NULL;
+    stream.next = 0;
+    stream.n = num_samples;
+    stream.window = window;
+    stream.labels = (uint8_t *) malloc(window);
+    stream.num_correct = 0;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t start = 1000000L * tv.tv_sec + tv.tv_usec;
+
+    printf("Running classification...\n");
+    long done = net_classify_stream(net, read_sample, &stream, score_sample, &stream, window);
+
+    gettimeofday(&tv, NULL);
+    uint64_t end = 1000000L * tv.tv_sec + tv.tv_usec;
+
+    assert(done == num_samples);
+    printf("%lf%% accuracy\n", done > 0 ? 100.0 * stream.num_correct / done : 0.0);
+    printf("%ld microseconds\n", end - start);
+
+    if (stream.fin != NULL) {
+        fclose(stream.fin);
+    }
+    free(stream.labels);
+    free_network(net);
+}
+
+// Session callback that counts the finished requests.
+void count_request(void *ctx) {
+    __atomic_fetch_add((int *) ctx, 1, __ATOMIC_RELAXED);
+}
+
+// Classify n samples (DEFAULT_BENCHMARK_SIZE if not specified) as a series of
+// small requests (of SESSION_REQUEST_SIZE images if not specified): once with
+// one net_classify_output call per request, and twice through a persistent
+// session, which does not start threads or allocate batches per request:
+// waiting for every request before submitting the next one, and submitting
+// all of them asynchronously so that consecutive requests overlap.
+void do_session(int argc, char **argv) {
+    int num_samples = DEFAULT_BENCHMARK_SIZE;
+    int request_size = SESSION_REQUEST_SIZE;
+    if (argc > 0)
+        num_samples = atoi(argv[0]);
+    if (argc > 1)
+        request_size = atoi(argv[1]);
+
+    assert(num_samples > 0 && request_size > 0);
+
+    printf("CLASSIFYING %d PICTURES IN REQUESTS OF %d...\n", num_samples, request_size);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    int *samples = (int *) malloc(sizeof(int)*num_samples);
+    for (int i = 0; i < num_samples; i++) {
+        samples[i] = i % 50000;
+    }
+    batch_t batches[MAX_BATCHES];
+    volume_t **input = load_inputs(samples, num_samples, batches);
+
+    net_output_t per_call, per_session;
+    per_call.mode = NET_OUTPUT_DOUBLE;
+    per_call.likelihoods = (double *) malloc(sizeof(double) * num_samples * NUM_CLASSES);
+    per_session.mode = NET_OUTPUT_DOUBLE;
+    per_session.likelihoods = (double *) malloc(sizeof(double) * num_samples * NUM_CLASSES);
+
+    uint64_t start = now_us();
+    for (int i = 0; i < num_samples; i += request_size) {
+        int size = num_samples - i < request_size ? num_samples - i : request_size;
+        net_output_t request = per_call;
+        request.likelihoods += i * NUM_CLASSES;
+        net_classify_output(net, input + i, &request, size);
+    }
+    uint64_t per_call_us = now_us() - start;
+
+    session_t *session = make_session(net, 0);
+    net_output_t request = per_session;
+
+    start = now_us();
+    for (int i = 0; i < num_samples; i += request_size) {
+        int size = num_samples - i < request_size ? num_samples - i : request_size;
+        request.likelihoods = per_session.likelihoods + i * NUM_CLASSES;
+        session_submit(session, input + i, &request, size);
+        session_wait(session);
+    }
+    uint64_t per_session_us = now_us() - start;
+
+    // The same requests, but all submitted up front so that they overlap.
+    int num_requests = (num_samples + request_size - 1) / request_size;
+    net_output_t *requests = (net_output_t *) malloc(sizeof(net_output_t) * num_requests);
+    session_job_t **jobs = (session_job_t **) malloc(sizeof(session_job_t *) * num_requests);
+    double *async_likelihoods = (double *) malloc(sizeof(double) * num_samples * NUM_CLASSES);
+    int finished = 0;
+
+    start = now_us();
+    for (int r = 0; r < num_requests; r++) {
+        int i = r * request_size;
+        int size = num_samples - i < request_size ? num_samples - i : request_size;
+        requests[r].mode = NET_OUTPUT_DOUBLE;
+        requests[r].likelihoods = async_likelihoods + i * NUM_CLASSES;
+        jobs[r] = session_submit_async(session, input + i, &requests[r], size, count_request, &finished);
+    }
+    for (int r = 0; r < num_requests; r++) {
+        session_wait_job(session, jobs[r]);
+    }
+    uint64_t async_us = now_us() - start;
+
+    free_session(session);
+
+    assert(finished == num_requests);
+    for (int i = 0; i < num_samples * NUM_CLASSES; i++) {
+        assert(per_call.likelihoods[i] == per_session.likelihoods[i]);
+        assert(per_call.likelihoods[i] == async_likelihoods[i]);
+    }
+
+    printf("net_classify_output: %ld microseconds\n", per_call_us);
+    printf("session: %ld microseconds\n", per_session_us);
+    printf("session (async): %ld microseconds\n", async_us);
+
+    free(jobs);
+    free(requests);
+    free(async_likelihoods);
+    free(per_call.likelihoods);
+    free(per_session.likelihoods);
+    free(input);
+    free_batches(batches);
+    free(samples);
+    free_network(net);
+}
+
+int compare_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the n values and returns the median.
+uint64_t median(uint64_t *values, int n) {
+    qsort(values, n, sizeof(uint64_t), compare_uint64);
+    return values[n / 2];
+}
+
+// Returns the p-th percentile (nearest rank) of n values that are already
+// sorted.
+uint64_t percentile(uint64_t *sorted, int n, double p) {
+    int rank = (int) ceil(p / 100.0 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Classify n samples (INTERACTIVE_SIZE if not specified) one request at a
+// time, as an interactive service would, and compare the median latency of
+// one thread per image with that of all threads working on the same image.
+void do_interactive(int argc, char **argv) {
+    int num_samples = INTERACTIVE_SIZE;
+    if (argc > 0)
+        num_samples = atoi(argv[0]);
+
+    assert(num_samples > 0);
+
+    printf("CLASSIFYING %d PICTURES ONE AT A TIME...\n", num_samples);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    int *samples = (int *) malloc(sizeof(int)*num_samples);
+    for (int i = 0; i < num_samples; i++) {
+        samples[i] = i % 50000;
+    }
+    batch_t batches[MAX_BATCHES];
+    volume_t **input = load_inputs(samples, num_samples, batches);
+
+    uint64_t *per_image = (uint64_t *) malloc(sizeof(uint64_t) * num_samples);
+    uint64_t *intra_image = (uint64_t *) malloc(sizeof(uint64_t) * num_samples);
+    double expected[NUM_CLASSES];
+    double likelihoods[NUM_CLASSES];
+    batch_t *b = make_batch_view(net, 1);
+
+    net_output_t out;
+    out.mode = NET_OUTPUT_DOUBLE;
+    out.likelihoods = expected;
+
+    for (int i = 0; i < num_samples; i++) {
+        uint64_t start = now_us();
+        net_classify_output(net, input + i, &out, 1);
+        per_image[i] = now_us() - start;
+
+        start = now_us();
+        net_classify_latency(net, b, input[i], likelihoods);
+        intra_image[i] = now_us() - start;
+
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            assert(likelihoods[c] == expected[c]);
+        }
+    }
+
+    printf("one thread per image: %ld microseconds (median)\n", median(per_image, num_samples));
+    printf("%d threads per image: %ld microseconds (median)\n", omp_get_max_threads(),
+            median(intra_image, num_samples));
+
+    free_batch_view(b, 1);
+    free(per_image);
+    free(intra_image);
+    free(input);
+    free_batches(batches);
+    free(samples);
+    free_network(net);
+}
+
+// Calibrate the adaptive scheduler, then classify requests of 1, 2, 4, ... up
+// to n images (ADAPTIVE_MAX_REQUEST if not specified) with it and with one
+// thread per image, and show which split it chose for every request size.
+void do_adaptive(int argc, char **argv) {
+    int max_request = ADAPTIVE_MAX_REQUEST;
+    if (argc > 0)
+        max_request = atoi(argv[0]);
+
+    assert(max_request > 0);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    int *samples = (int *) malloc(sizeof(int)*max_request);
+    for (int i = 0; i < max_request; i++) {
+        samples[i] = i % 50000;
+    }
+    batch_t batches[MAX_BATCHES];
+    volume_t **input = load_inputs(samples, max_request, batches);
+
+    printf("Calibrating...\n");
+    net_calibrate(net);
+
+    net_output_t expected, adaptive;
+    expected.mode = NET_OUTPUT_DOUBLE;
+    expected.likelihoods = (double *) malloc(sizeof(double) * max_request * NUM_CLASSES);
+    adaptive.mode = NET_OUTPUT_DOUBLE;
+    adaptive.likelihoods = (double *) malloc(sizeof(double) * max_request * NUM_CLASSES);
+
+    printf("images,threads_per_image,per_image_us,adaptive_us\n");
+    for (int n = 1; n <= max_request; n *= 2) {
+        uint64_t start = now_us();
+        net_classify_output(net, input, &expected, n);
+        uint64_t per_image_us = now_us() - start;
+
+        start = now_us();
+        net_classify_adaptive(net, input, &adaptive, n);
+        uint64_t adaptive_us = now_us() - start;
+
+        for (int i = 0; i < n * NUM_CLASSES; i++) {
+            assert(expected.likelihoods[i] == adaptive.likelihoods[i]);
+        }
+
+        printf("%d,%d,%ld,%ld\n", n, net_threads_per_image(n), per_image_us, adaptive_us);
+    }
+
+    free(expected.likelihoods);
+    free(adaptive.likelihoods);
+    free(input);
+    free_batches(batches);
+    free(samples);
+    free_network(net);
+}
+
+// Classify n images (DEFAULT_BENCHMARK_SIZE if not specified) with the layer
+// pipeline, with at most depth images in flight, and compare it against
+// net_classify_output.
+void do_pipeline(int argc, char **argv) {
+    int num_samples = DEFAULT_BENCHMARK_SIZE;
+    int depth = 0;
+    if (argc > 0)
+        num_samples = atoi(argv[0]);
+    if (argc > 1)
+        depth = atoi(argv[1]);
+
+    assert(num_samples > 0 && depth >= 0);
+
+    printf("CLASSIFYING %d PICTURES WITH A %d-STAGE PIPELINE...\n", num_samples, PIPELINE_DEFAULT_STAGES);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    int *samples = (int *) malloc(sizeof(int)*num_samples);
+    for (int i = 0; i < num_samples; i++) {
+        samples[i] = i % 50000;
+    }
+    batch_t batches[MAX_BATCHES];
+    volume_t **input = load_inputs(samples, num_samples, batches);
+
+    net_output_t expected, pipelined;
+    expected.mode = NET_OUTPUT_DOUBLE;
+    expected.likelihoods = (double *) malloc(sizeof(double) * num_samples * NUM_CLASSES);
+    pipelined.mode = NET_OUTPUT_DOUBLE;
+    pipelined.likelihoods = (double *) malloc(sizeof(double) * num_samples * NUM_CLASSES);
+
+    uint64_t start = now_us();
+    net_classify_output(net, input, &expected, num_samples);
+    uint64_t per_image_us = now_us() - start;
+
+    pipeline_t *pipeline = make_pipeline(net, PIPELINE_DEFAULT_STAGES, NULL, depth);
+
+    start = now_us();
+    pipeline_classify(pipeline, input, &pipelined, num_samples);
+    uint64_t pipeline_us = now_us() - start;
+
+    free_pipeline(pipeline);
+
+    for (int i = 0; i < num_samples * NUM_CLASSES; i++) {
+        assert(expected.likelihoods[i] == pipelined.likelihoods[i]);
+    }
+
+    printf("net_classify_output: %ld microseconds\n", per_image_us);
+    printf("pipeline: %ld microseconds\n", pipeline_us);
+
+    free(expected.likelihoods);
+    free(pipelined.likelihoods);
+    free(input);
+    free_batches(batches);
+    free(samples);
+    free_network(net);
+}
+
 // Run test of classifying individual samples and check the content of every layer
 // against reference output produced by convnet.js.
 void do_layers_test(int argc, char **argv) {
@@ -256,6 +679,31 @@ void do_layers_test(int argc, char **argv) {
     free_batch(batch, 1);
 }
 
+// Prints the likelihoods of the n images in the format expected by
+// test/compare_output.py.
+void print_parallel_test(double *kept_output, int n) {
+    for (int i = 0; i < n; i++) {
+        double *likelihoods = kept_output + i * NUM_CLASSES;
+        printf("PAR%d,", i);
+        for (int c = 0; c < NUM_CLASSES - 1; c++) {
+            printf("%lf,", likelihoods[c]);
+        }
+        printf("%lf\n", likelihoods[NUM_CLASSES - 1]);
+    }
+}
+
+// Returns the samples of a parallel test of n images. The samples of a smaller
+// test are a prefix of those of a larger one.
+int *partest_samples(int n) {
+    srand(1234);
+
+    int *samples = (int *) malloc(sizeof(int)*n);
+    for (int i = 0; i < n; i++) {
+        samples[i] = (int) ((double)rand() / ((double)RAND_MAX + 1) * 50000);
+    }
+    return samples;
+}
+
 // Run a large-scale test to catch parallelism errors that do not occur when testing
 // on individual examples.
 void do_parallel_test(int argc, char **argv) {
@@ -264,33 +712,712 @@ void do_parallel_test(int argc, char **argv) {
     if (argc > 0)
         test_size = atoi(argv[0]);
 
-    srand(1234);
+    int *samples = partest_samples(test_size);
+
+    double *kept_output;
+    run_classification(samples, test_size, &kept_output);
+
+    print_parallel_test(kept_output, test_size);
+
+    mem_free(kept_output);
+    free(samples);
+}
+
+// Like partest (and with the same output), but run as a coordinator with
+// num_workers worker processes (one per OpenMP thread if not specified). The
+// coordinator parses the snapshot and loads the samples once, then forks the
+// workers, each pinned to its own CPU, and gives each a contiguous shard of
+// the samples. Samples and results are in shared memory. The weights are
+// shared copy-on-write: the workers never write them, so all processes keep
+// mapping the same pages.
+void do_sharded_test(int argc, char **argv) {
+    int test_size = PARTEST_SIZE;
+    int num_workers = omp_get_max_threads();
 
-    int *samples = (int *) malloc(sizeof(int)*test_size);
+    if (argc > 0)
+        test_size = atoi(argv[0]);
+    if (argc > 1)
+        num_workers = atoi(argv[1]);
+
+    assert(test_size > 0 && num_workers > 0);
+
+    int *samples = partest_samples(test_size);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    batch_t batches[MAX_BATCHES];
+    volume_t **loaded = load_inputs(samples, test_size, batches);
+
+    // One shared mapping for the input images followed by the results.
+    size_t image_size = (size_t) net->layers[0]->width * net->layers[0]->height * net->layers[0]->depth;
+    size_t shared_size = sizeof(double) * ((image_size + NUM_CLASSES) * test_size);
+    double *shared = (double *) mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(shared != MAP_FAILED);
+    double *images = shared;
+    double *results = shared + image_size * test_size;
+
+    volume_t **input = (volume_t **) malloc(sizeof(volume_t*)*test_size);
     for (int i = 0; i < test_size; i++) {
-        samples[i] = (int) ((double)rand() / ((double)RAND_MAX + 1) * 50000);
+        memcpy(images + i * image_size, loaded[i]->weights, sizeof(double) * image_size);
+        input[i] = make_volume_view(loaded[i]->width, loaded[i]->height, loaded[i]->depth, images + i * image_size);
+    }
+    free(loaded);
+    free_batches(batches);
+
+    // Otherwise every worker would print the buffered output again.
+    fflush(stdout);
+
+    pid_t *workers = (pid_t *) malloc(sizeof(pid_t) * num_workers);
+    for (int w = 0; w < num_workers; w++) {
+        workers[w] = fork();
+        assert(workers[w] >= 0);
+        if (workers[w] == 0) {
+            pin_to_cpu(allowed_cpu(w));
+
+            net_output_t out;
+            out.mode = NET_OUTPUT_DOUBLE;
+            out.likelihoods = results;
+
+            batch_t *b = make_batch_view(net, 1);
+            int end = (int) ((long) test_size * (w + 1) / num_workers);
+            for (int i = (int) ((long) test_size * w / num_workers); i < end; i++) {
+                bind_input(b, 0, input[i]);
+                net_forward(net, b, 0, 0);
+                net_store_output(&out, i, b[NUM_LAYERS][0]->weights);
+            }
+            _exit(0);
+        }
     }
 
-    double **kept_output;
-    run_classification(samples, test_size, &kept_output);
+    // A crashed worker only loses its own shard, but then the results are
+    // incomplete.
+    int failed = 0;
+    for (int w = 0; w < num_workers; w++) {
+        int status;
+        waitpid(workers[w], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("ERROR: Worker %d failed\n", w);
+            failed = 1;
+        }
+    }
+    assert(!failed);
+
+    print_parallel_test(results, test_size);
 
     for (int i = 0; i < test_size; i++) {
-        printf("PAR%d,", i);
-        for (int c = 0; c < NUM_CLASSES - 1; c++) {
-            printf("%lf,", kept_output[i][c]);
+        free_volume_view(input[i]);
+    }
+    free(input);
+    free(workers);
+    munmap(shared, shared_size);
+    free(samples);
+    free_network(net);
+}
+
+// The server run by do_serve, so that the signal handler can stop it.
+server_t *running_server;
+
+void stop_server(int signal) {
+    server_stop(running_server);
+}
+
+// Serve classification requests on a Unix domain socket (SOCKET_PATH if not
+// specified) until interrupted, in micro-batches of up to max_batch images
+// that wait at most max_wait_us microseconds for more requests to arrive.
+void do_serve(int argc, char **argv) {
+    const char *socket_path = SOCKET_PATH;
+    int max_batch = SERVER_MAX_BATCH;
+    int max_wait_us = SERVER_MAX_WAIT_US;
+    if (argc > 0)
+        socket_path = argv[0];
+    if (argc > 1)
+        max_batch = atoi(argv[1]);
+    if (argc > 2)
+        max_wait_us = atoi(argv[2]);
+
+    assert(max_batch > 0 && max_wait_us >= 0);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    running_server = make_server(net, socket_path, max_batch, max_wait_us, decode_sample);
+    if (running_server == NULL) {
+        if (errno == EADDRINUSE) {
+            printf("ERROR: %s is already in use by another server\n", socket_path);
+        } else {
+            printf("ERROR: %s exists and is not a socket\n", socket_path);
         }
-        printf("%lf\n", kept_output[i][NUM_CLASSES - 1]);
+        free_network(net);
+        return;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Listening on %s (batches of up to %d images, waiting up to %d microseconds)...\n",
+           socket_path, max_batch, max_wait_us);
+    fflush(stdout);
+
+    server_run(running_server);
+
+    printf("Served %ld requests in %ld batches\n", running_server->requests, running_server->batches);
+
+    free_server(running_server);
+    free_network(net);
+}
+
+// State of one client thread of the load generator.
+typedef struct load_client {
+    const char *socket_path;
+    const uint8_t *data;
+    int first;
+    int count;
+    uint64_t *latencies;
+    int correct;
+} load_client_t;
+
+void *run_load_client(void *arg) {
+    load_client_t *c = (load_client_t *) arg;
+
+    int fd = server_connect(c->socket_path);
+    assert(fd >= 0);
+
+    c->correct = 0;
+    for (int r = 0; r < c->count; r++) {
+        const uint8_t *record = c->data + ((c->first + r) % 10000) * 3073;
+        double likelihoods[NUM_CLASSES];
+
+        uint64_t start = now_us();
+        assert(server_request(fd, record, likelihoods));
+        c->latencies[r] = now_us() - start;
+
+        if (best_class(likelihoods) == record[0]) {
+            c->correct++;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Load generator for do_serve: num_clients concurrent clients (LOAD_CLIENTS if
+// not specified) each send num_requests images of the first data batch, one
+// at a time, and the throughput and latency percentiles are reported.
+void do_load(int argc, char **argv) {
+    const char *socket_path = SOCKET_PATH;
+    int num_clients = LOAD_CLIENTS;
+    int num_requests = LOAD_REQUESTS;
+    if (argc > 0)
+        socket_path = argv[0];
+    if (argc > 1)
+        num_clients = atoi(argv[1]);
+    if (argc > 2)
+        num_requests = atoi(argv[2]);
+
+    assert(num_clients > 0 && num_requests > 0);
+
+    char file_name[1024];
+    sprintf(file_name, "%s/data_batch_1.bin", DATA_FOLDER);
+    FILE *fin = fopen(file_name, "rb");
+    assert(fin != NULL);
+    uint8_t *data = malloc(3073 * 10000);
+    assert(fread(data, 1, 3073 * 10000, fin) == 3073 * 10000);
+    fclose(fin);
+
+    int total = num_clients * num_requests;
+    uint64_t *latencies = (uint64_t *) malloc(sizeof(uint64_t) * total);
+    load_client_t *clients = (load_client_t *) malloc(sizeof(load_client_t) * num_clients);
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * num_clients);
+
+    printf("SENDING %d REQUESTS FROM %d CLIENTS...\n", total, num_clients);
+
+    uint64_t start = now_us();
+    for (int c = 0; c < num_clients; c++) {
+        clients[c].socket_path = socket_path;
+        clients[c].data = data;
+        clients[c].first = c * num_requests;
+        clients[c].count = num_requests;
+        clients[c].latencies = latencies + c * num_requests;
+        int err = pthread_create(&threads[c], NULL, run_load_client, &clients[c]);
+        assert(err == 0);
+    }
+    int correct = 0;
+    for (int c = 0; c < num_clients; c++) {
+        pthread_join(threads[c], NULL);
+        correct += clients[c].correct;
+    }
+    uint64_t elapsed_us = now_us() - start;
+
+    qsort(latencies, total, sizeof(uint64_t), compare_uint64);
+
+    printf("Throughput: %.1f requests/s\n", total * 1e6 / elapsed_us);
+    printf("Latency p50: %ld microseconds\n", percentile(latencies, total, 50));
+    printf("Latency p90: %ld microseconds\n", percentile(latencies, total, 90));
+    printf("Latency p99: %ld microseconds\n", percentile(latencies, total, 99));
+    printf("Latency max: %ld microseconds\n", latencies[total - 1]);
+    printf("Accuracy: %f\n", (double) correct / total);
+
+    free(threads);
+    free(clients);
+    free(latencies);
+    free(data);
+}
+
+// Result of one point of the scaling sweep.
+typedef struct scaling_point {
+    const char *kind;
+    int threads;
+    int images;
+    double seconds;
+} scaling_point_t;
+
+// Classifies the first n images with the given number of threads
+// SCALING_REPEATS times, checks the results against the reference and returns
+// the best time in seconds.
+double time_classify(network_t *net, volume_t **input, int n, int threads, int pinned, net_output_t *out,
+                     double *reference) {
+    omp_set_num_threads(threads);
+    if (pinned) {
+        #pragma omp parallel
+        pin_to_cpu(allowed_cpu(omp_get_thread_num()));
+    }
+
+    double best = INFINITY;
+    for (int r = 0; r < SCALING_REPEATS; r++) {
+        double start = omp_get_wtime();
+        net_classify_output(net, input, out, n);
+        double elapsed = omp_get_wtime() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+
+    if (reference != NULL) {
+        for (int i = 0; i < n * NUM_CLASSES; i++) {
+            assert(out->likelihoods[i] == reference[i]);
+        }
+    }
+    return best;
+}
+
+// Sweep the number of threads from 1 to max_threads (the OpenMP default if not
+// specified) in powers of two, and measure how net_classify scales: with a
+// fixed number of images (strong scaling, n images, DEFAULT_BENCHMARK_SIZE if
+// not specified) and with a fixed number of images per thread (weak scaling,
+// n / max_threads images per thread). With pinned set to 1, every thread is
+// pinned to its own CPU. The results are printed as csv (the default) or json.
+void do_scaling(int argc, char **argv) {
+    int num_samples = DEFAULT_BENCHMARK_SIZE;
+    int max_threads = omp_get_max_threads();
+    int pinned = 0;
+    const char *format = "csv";
+    if (argc > 0)
+        num_samples = atoi(argv[0]);
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        pinned = atoi(argv[2]);
+    if (argc > 3)
+        format = argv[3];
+
+    assert(max_threads > 0 && num_samples >= max_threads);
+    assert(!strcmp(format, "csv") || !strcmp(format, "json"));
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    int *samples = (int *) malloc(sizeof(int)*num_samples);
+    for (int i = 0; i < num_samples; i++) {
+        samples[i] = i % 50000;
+    }
+    batch_t batches[MAX_BATCHES];
+    volume_t **input = load_inputs(samples, num_samples, batches);
+
+    net_output_t out;
+    out.mode = NET_OUTPUT_DOUBLE;
+    out.likelihoods = (double *) malloc(sizeof(double) * num_samples * NUM_CLASSES);
+    double *reference = (double *) malloc(sizeof(double) * num_samples * NUM_CLASSES);
+
+    // The single-threaded run (after a warmup) is both the baseline for the
+    // speedups and the reference for the results of every other run.
+    printf("Running classification...\n");
+    time_classify(net, input, num_samples, 1, pinned, &out, NULL);
+    memcpy(reference, out.likelihoods, sizeof(double) * num_samples * NUM_CLASSES);
+
+    int num_counts = 0;
+    int thread_counts[64];
+    for (int t = 1; t < max_threads && num_counts < 63; t *= 2) {
+        thread_counts[num_counts++] = t;
+    }
+    thread_counts[num_counts++] = max_threads;
+
+    int per_thread = num_samples / max_threads;
+    scaling_point_t *points = (scaling_point_t *) malloc(sizeof(scaling_point_t) * 2 * num_counts);
+    for (int i = 0; i < num_counts; i++) {
+        int t = thread_counts[i];
+        points[2 * i] = (scaling_point_t) {"strong", t, num_samples,
+                time_classify(net, input, num_samples, t, pinned, &out, reference)};
+        points[2 * i + 1] = (scaling_point_t) {"weak", t, per_thread * t,
+                time_classify(net, input, per_thread * t, t, pinned, &out, reference)};
+    }
+
+    // Speedups are relative to the single-threaded point of the same kind, in
+    // images per second, so that they also make sense for weak scaling.
+    int json = !strcmp(format, "json");
+    if (json) {
+        printf("{\"max_threads\": %d, \"pinned\": %d, \"results\": [\n", max_threads, pinned);
+    } else {
+        printf("kind,threads,images,seconds,images_per_second,speedup,efficiency\n");
+    }
+    for (int i = 0; i < 2 * num_counts; i++) {
+        scaling_point_t *p = &points[i];
+        double throughput = p->images / p->seconds;
+        double speedup = throughput / (points[i % 2].images / points[i % 2].seconds);
+        if (json) {
+            printf("  {\"kind\": \"%s\", \"threads\": %d, \"images\": %d, \"seconds\": %f, "
+                   "\"images_per_second\": %f, \"speedup\": %f, \"efficiency\": %f}%s\n", p->kind, p->threads,
+                   p->images, p->seconds, throughput, speedup, speedup / p->threads,
+                   i + 1 < 2 * num_counts ? "," : "");
+        } else {
+            printf("%s,%d,%d,%f,%f,%f,%f\n", p->kind, p->threads, p->images, p->seconds, throughput, speedup,
+                   speedup / p->threads);
+        }
+    }
+    if (json) {
+        printf("]}\n");
+    }
+
+    free(points);
+    free(reference);
+    free(out.likelihoods);
+    free(input);
+    free_batches(batches);
+    free(samples);
+    free_network(net);
+}
+
+// Classify warmup images (LATENCY_WARMUP_SIZE if not specified), then n images
+// (DEFAULT_BENCHMARK_SIZE if not specified) with the duration of every
+// forward pass recorded, and report the throughput and the latency
+// distribution of both phases.
+void do_latency(int argc, char **argv) {
+    int num_samples = DEFAULT_BENCHMARK_SIZE;
+    int warmup = LATENCY_WARMUP_SIZE;
+    if (argc > 0)
+        num_samples = atoi(argv[0]);
+    if (argc > 1)
+        warmup = atoi(argv[1]);
+
+    assert(num_samples > 0 && warmup >= 0);
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+
+    int total = num_samples > warmup ? num_samples : warmup;
+    int *samples = (int *) malloc(sizeof(int)*total);
+    for (int i = 0; i < total; i++) {
+        samples[i] = i % 50000;
     }
+    batch_t batches[MAX_BATCHES];
+    volume_t **input = load_inputs(samples, total, batches);
+
+    net_output_t out;
+    out.mode = NET_OUTPUT_DOUBLE;
+    out.likelihoods = (double *) malloc(sizeof(double) * total * NUM_CLASSES);
 
+    latency_enable(1);
+    latency_reset();
+
+    printf("Running classification...\n");
+    latency_set_phase(LATENCY_WARMUP);
+    uint64_t start = now_us();
+    net_classify_output(net, input, &out, warmup);
+    uint64_t warmup_us = now_us() - start;
+
+    latency_set_phase(LATENCY_STEADY);
+    start = now_us();
+    net_classify_output(net, input, &out, num_samples);
+    uint64_t steady_us = now_us() - start;
+
+    if (warmup > 0) {
+        printf("Warmup: %d images in %ld microseconds (%.1f images/s)\n", warmup, warmup_us,
+               warmup * 1e6 / warmup_us);
+    }
+    printf("Steady state: %d images in %ld microseconds (%.1f images/s)\n", num_samples, steady_us,
+           num_samples * 1e6 / steady_us);
+    latency_report();
+
+    latency_enable(0);
+    free(out.likelihoods);
+    free(input);
+    free_batches(batches);
     free(samples);
+    free_network(net);
+}
+
+int compare_int(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+// Prints a mismatch found by compare_record in the words of the comparison
+// scripts.
+void print_mismatch(reference_t *ref, mismatch_t *m) {
+    if (m->index < 0) {
+        printf("ERROR: Dimensionality error in %s (expected: %.0f, was: %.0f)\n", ref->tags[m->record], m->expected,
+               m->value);
+    } else {
+        printf("ERROR: Value %d at %s is wrong: %.20lf (should be %.20lf, %lu ulps apart)\n", m->index + 1,
+               ref->tags[m->record], m->value, m->expected, m->ulps);
+    }
+}
+
+// Classifies the first size samples of partest and checks the likelihoods
+// against ref. Returns 1 if they match.
+int verify_partest(reference_t *ref, int size) {
+    int *samples = partest_samples(size);
+    double *kept_output;
+    run_classification(samples, size, &kept_output);
+    free(samples);
+
+    printf("PARALLEL TEST %d... ", size);
+    int passed = 0;
+    if (ref->num_records != size) {
+        printf("ERROR: Expected %d outputs in the reference, found %d\n", size, ref->num_records);
+    } else {
+        // Find the first mismatch in parallel, then report it.
+        int first = size;
+#pragma omp parallel for reduction(min:first)
+        for (int i = 0; i < size; i++) {
+            char tag[VALIDATE_TAG_SIZE];
+            mismatch_t m;
+            sprintf(tag, "PAR%d", i);
+            if (strcmp(ref->tags[i], tag) ||
+                !compare_record(ref, i, kept_output + i * NUM_CLASSES, NUM_CLASSES, "%lf", &m)) {
+                first = i < first ? i : first;
+            }
+        }
+
+        mismatch_t m;
+        if (first == size) {
+            printf("Passed\n");
+            passed = 1;
+        } else if (!compare_record(ref, first, kept_output + first * NUM_CLASSES, NUM_CLASSES, "%lf", &m)) {
+            print_mismatch(ref, &m);
+        } else {
+            printf("ERROR: Invalid reference data for output %d\n", first);
+        }
+    }
+
+    mem_free(kept_output);
+    return passed;
+}
+
+// Check every layer test (<n>.txt) and every parallel test (par<n>.txt) in the
+// reference folder (test/ref if not specified) in-process, with the same
+// tolerances as test/compare_layers.py and test/compare_output.py. The
+// references are cached in binary form in test/out. Layer tests are checked in
+// parallel, and every parallel test runs its own classification (so bugs that
+// depend on the number of images show up). Returns 0 if everything matches, 1
+// otherwise.
+int do_verify(int argc, char **argv) {
+    const char *ref_dir = "test/ref";
+    if (argc > 0)
+        ref_dir = argv[0];
+
+    DIR *dir = opendir(ref_dir);
+    if (dir == NULL) {
+        printf("ERROR: Cannot open %s\n", ref_dir);
+        return 2;
+    }
+
+    // Find the references.
+    int layer_tests[VERIFY_MAX_FILES], par_sizes[VERIFY_MAX_FILES];
+    int num_layer_tests = 0, num_par_sizes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char name[64];
+        int k;
+        if (sscanf(entry->d_name, "par%d", &k) == 1) {
+            snprintf(name, sizeof(name), "par%d.txt", k);
+            if (!strcmp(name, entry->d_name) && k > 0 && num_par_sizes < VERIFY_MAX_FILES) {
+                par_sizes[num_par_sizes++] = k;
+            }
+        } else if (sscanf(entry->d_name, "%d", &k) == 1) {
+            snprintf(name, sizeof(name), "%d.txt", k);
+            if (!strcmp(name, entry->d_name) && k >= 0 && k < 50000 && num_layer_tests < VERIFY_MAX_FILES) {
+                layer_tests[num_layer_tests++] = k;
+            }
+        }
+    }
+    closedir(dir);
+    qsort(layer_tests, num_layer_tests, sizeof(int), compare_int);
+    qsort(par_sizes, num_par_sizes, sizeof(int), compare_int);
+
+    // Load all references at once.
+    mkdir("test/out", 0755);
+    int num_files = num_layer_tests + num_par_sizes;
+    reference_t **refs = (reference_t **) malloc(sizeof(reference_t *) * (num_files > 0 ? num_files : 1));
+#pragma omp parallel for schedule(dynamic)
+    for (int f = 0; f < num_files; f++) {
+        char file_name[1024];
+        if (f < num_layer_tests) {
+            sprintf(file_name, "%s/%d.txt", ref_dir, layer_tests[f]);
+        } else {
+            sprintf(file_name, "%s/par%d.txt", ref_dir, par_sizes[f - num_layer_tests]);
+        }
+        refs[f] = load_reference_cached(file_name, "test/out");
+        assert(refs[f] != NULL);
+    }
+
+    printf("Making network...\n");
+    network_t *net = load_cnn_snapshot();
+    int failed = 0;
+
+    // Layer tests: the test number is the sample.
+    if (num_layer_tests > 0) {
+        batch_t batches[MAX_BATCHES];
+        volume_t **input = load_inputs(layer_tests, num_layer_tests, batches);
+        int *passed = (int *) malloc(sizeof(int) * num_layer_tests);
+        mismatch_t *mismatches = (mismatch_t *) malloc(sizeof(mismatch_t) * num_layer_tests);
+
+#pragma omp parallel for schedule(dynamic)
+        for (int t = 0; t < num_layer_tests; t++) {
+            batch_t *b = make_batch(net, 1);
+            copy_volume(b[0][0], input[t]);
+            net_forward(net, b, 0, 0);
+
+            passed[t] = 1;
+            for (int l = 0; l < NUM_LAYERS + 1 && passed[t]; l++) {
+                char tag[VALIDATE_TAG_SIZE];
+                sprintf(tag, "LAYER%d", l);
+                int r = find_record(refs[t], tag);
+                assert(r >= 0);
+
+                // In the order of dump_volume: the shape, then x, y, z.
+                volume_t *v = b[l][0];
+                int n = 3 + v->width * v->height * v->depth;
+                double *values = (double *) malloc(sizeof(double) * n);
+                values[0] = v->width;
+                values[1] = v->height;
+                values[2] = v->depth;
+                int i = 3;
+                for (int x = 0; x < v->width; x++) {
+                    for (int y = 0; y < v->height; y++) {
+                        for (int z = 0; z < v->depth; z++) {
+                            values[i++] = volume_get(v, x, y, z);
+                        }
+                    }
+                }
+                passed[t] = compare_record(refs[t], r, values, n, "%.20lf", &mismatches[t]);
+                free(values);
+            }
+            free_batch(b, 1);
+        }
+
+        for (int t = 0; t < num_layer_tests; t++) {
+            printf("RUNNING TEST %d... ", layer_tests[t]);
+            if (passed[t]) {
+                printf("Passed\n");
+            } else {
+                print_mismatch(refs[t], &mismatches[t]);
+                failed = 1;
+            }
+        }
+
+        free(passed);
+        free(mismatches);
+        free(input);
+        free_batches(batches);
+    }
+
+    // Parallel tests, each with its own classification.
+    for (int s = 0; s < num_par_sizes; s++) {
+        if (!verify_partest(refs[num_layer_tests + s], par_sizes[s])) {
+            failed = 1;
+        }
+    }
+
+    printf("%s\n", failed ? "SOME TESTS FAILED" : "ALL TESTS PASSED");
+
+    for (int f = 0; f < num_files; f++) {
+        free_reference(refs[f]);
+    }
+    free(refs);
+    free_network(net);
+    return failed;
+}
+
+// Prints the latency histograms at exit, unless a command has already reported
+// them (and turned recording off).
+void report_latency(void) {
+    if (latency_enabled) {
+        latency_report();
+    }
+}
+
+// Frees the result cache at exit.
+void release_result_cache(void) {
+    net_set_result_cache(NULL);
+    free_result_cache(result_cache);
+    result_cache = NULL;
 }
 
 int main(int argc, char **argv) {
+    // The data set can be moved (or replaced by one written by gen_cifar)
+    // with CIFAR_DATA or with --data <folder> in front of the command.
+    if (getenv("CIFAR_DATA") != NULL) {
+        DATA_FOLDER = getenv("CIFAR_DATA");
+    }
+    if (argc > 2 && !strcmp(argv[1], "--data")) {
+        DATA_FOLDER = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+
     if (argc < 2) {
-        printf("Usage: ./benchmark <benchmark|test|partest> [args]\n");
+        printf("Usage: ./benchmark [--data <folder>] <benchmark|test|partest|stream|session|interactive|adaptive|pipeline|shard|serve|load|scaling|latency|verify> [args]\n");
         return 2;
     }
 
+    // The chunk size of the scheduler can be tuned without recompiling.
+    if (getenv("CHUNK_SIZE") != NULL) {
+        net_set_chunk_size(atoi(getenv("CHUNK_SIZE")));
+    }
+
+    // Per-layer profiling is off by default, as it adds two timer reads per
+    // layer. PROFILE=1 times the layers, PROFILE=2 also reads the hardware
+    // performance counters.
+    if (getenv("PROFILE") != NULL && atoi(getenv("PROFILE")) != 0) {
+        profile_enable(1, atoi(getenv("PROFILE")) >= 2);
+    }
+
+    // LATENCY=1 records the duration of every forward pass (see latency.h),
+    // and prints the histograms when the command is done.
+    if (getenv("LATENCY") != NULL && atoi(getenv("LATENCY")) != 0) {
+        latency_enable(1);
+        atexit(report_latency);
+    }
+
+    // TRACE=<file> writes a timeline of the run to file (see trace.h), with
+    // TRACE_EVENTS events per thread at most.
+    if (getenv("TRACE") != NULL) {
+        int events = TRACE_DEFAULT_EVENTS;
+        if (getenv("TRACE_EVENTS") != NULL) {
+            events = atoi(getenv("TRACE_EVENTS"));
+        }
+        trace_enable(getenv("TRACE"), events);
+    }
+
+    // So can the size of the result cache (off by default, and for sizes of 0
+    // or less).
+    if (getenv("RESULT_CACHE_MB") != NULL && atof(getenv("RESULT_CACHE_MB")) > 0) {
+        result_cache = make_result_cache((size_t) (atof(getenv("RESULT_CACHE_MB")) * 1024 * 1024), NUM_CLASSES);
+        net_set_result_cache(result_cache);
+        atexit(release_result_cache);
+    }
+
     if (!strcmp(argv[1], "benchmark")) {
         do_benchmark(argc-2, argv+2);
         return 0;
@@ -306,6 +1433,60 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    if (!strcmp(argv[1], "stream")) {
+        do_stream(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "session")) {
+        do_session(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "interactive")) {
+        do_interactive(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "adaptive")) {
+        do_adaptive(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "pipeline")) {
+        do_pipeline(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "shard")) {
+        do_sharded_test(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "serve")) {
+        do_serve(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "load")) {
+        do_load(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "scaling")) {
+        do_scaling(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "latency")) {
+        do_latency(argc-2, argv+2);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "verify")) {
+        return do_verify(argc-2, argv+2);
+    }
+
     printf("ERROR: Unknown command\n");
 
     return 2;
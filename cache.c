@@ -0,0 +1,144 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "volume.h"
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t v) {
+    h ^= rotl(v * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+    return rotl(h, 27) * 5 + 0x52dce729;
+}
+
+// Final avalanche step, so that every input bit affects every output bit.
+static inline uint64_t finalize(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+result_cache_t *make_result_cache(size_t max_bytes, int num_values) {
+    assert(num_values > 0);
+
+    size_t set_bytes = RESULT_CACHE_WAYS * (sizeof(result_cache_entry_t) + sizeof(double) * num_values) + sizeof(int);
+    if (max_bytes < set_bytes) {
+        max_bytes = set_bytes;
+    }
+
+    result_cache_t *cache = (result_cache_t *) malloc(sizeof(result_cache_t));
+    cache->num_values = num_values;
+    cache->num_sets = (int) (max_bytes / set_bytes);
+    cache->entries = (result_cache_entry_t *) calloc((size_t) cache->num_sets * RESULT_CACHE_WAYS,
+                                                     sizeof(result_cache_entry_t));
+    cache->values = (double *) malloc(sizeof(double) * num_values * RESULT_CACHE_WAYS * (size_t) cache->num_sets);
+    cache->victims = (int *) calloc(cache->num_sets, sizeof(int));
+    cache->bytes = set_bytes * cache->num_sets;
+    cache->hits = 0;
+    cache->misses = 0;
+
+    for (int i = 0; i < RESULT_CACHE_STRIPES; i++) {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+
+    return cache;
+}
+
+void free_result_cache(result_cache_t *cache) {
+    for (int i = 0; i < RESULT_CACHE_STRIPES; i++) {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+    free(cache->entries);
+    free(cache->values);
+    free(cache->victims);
+    free(cache);
+}
+
+result_cache_key_t result_cache_fingerprint(volume_t *v) {
+    size_t size = (size_t) v->width * v->height * v->depth;
+    const double *weights = v->weights;
+
+    // Four independent lanes, so consecutive words do not wait for each other.
+    uint64_t h[4] = {0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0xa4093822299f31d0ULL, 0x082efa98ec4e6c89ULL};
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t word;
+            memcpy(&word, weights + i + k, sizeof(word));
+            h[k] = mix(h[k], word);
+        }
+    }
+    for (; i < size; i++) {
+        uint64_t word;
+        memcpy(&word, weights + i, sizeof(word));
+        h[i % 4] = mix(h[i % 4], word);
+    }
+
+    uint64_t shape = ((uint64_t) v->width << 40) ^ ((uint64_t) v->height << 20) ^ (uint64_t) v->depth;
+    result_cache_key_t key;
+    key.hi = finalize(mix(h[0], shape) ^ rotl(h[2], 17) ^ size);
+    key.lo = finalize(mix(h[1], shape) ^ rotl(h[3], 41) ^ key.hi);
+    return key;
+}
+
+static inline int same_key(result_cache_key_t a, result_cache_key_t b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+int result_cache_lookup(result_cache_t *cache, result_cache_key_t key, double *values) {
+    int set = (int) (key.lo % (uint64_t) cache->num_sets);
+    pthread_mutex_t *lock = &cache->locks[set % RESULT_CACHE_STRIPES];
+    int found = 0;
+
+    pthread_mutex_lock(lock);
+    for (int w = 0; w < RESULT_CACHE_WAYS; w++) {
+        size_t e = (size_t) set * RESULT_CACHE_WAYS + w;
+        if (cache->entries[e].valid && same_key(cache->entries[e].key, key)) {
+            memcpy(values, cache->values + e * cache->num_values, sizeof(double) * cache->num_values);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    __atomic_fetch_add(found ? &cache->hits : &cache->misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+void result_cache_insert(result_cache_t *cache, result_cache_key_t key, const double *values) {
+    int set = (int) (key.lo % (uint64_t) cache->num_sets);
+    pthread_mutex_t *lock = &cache->locks[set % RESULT_CACHE_STRIPES];
+    result_cache_entry_t *entries = cache->entries + (size_t) set * RESULT_CACHE_WAYS;
+
+    pthread_mutex_lock(lock);
+
+    // Another thread may have inserted the same input in the meantime.
+    int way = -1;
+    for (int w = 0; w < RESULT_CACHE_WAYS; w++) {
+        if (entries[w].valid && same_key(entries[w].key, key)) {
+            pthread_mutex_unlock(lock);
+            return;
+        }
+        if (!entries[w].valid && way < 0) {
+            way = w;
+        }
+    }
+    if (way < 0) {
+        way = cache->victims[set];
+        cache->victims[set] = (way + 1) % RESULT_CACHE_WAYS;
+    }
+
+    size_t e = (size_t) set * RESULT_CACHE_WAYS + way;
+    entries[way].key = key;
+    entries[way].valid = 1;
+    memcpy(cache->values + e * cache->num_values, values, sizeof(double) * cache->num_values);
+
+    pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,67 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#include "volume.h"
+
+// A fixed-size cache of classification results, keyed by the content of the
+// input volume. Inputs are identified by a 128-bit fingerprint of their
+// dimensions and weights (the chance that two different images share one is
+// negligible), and the cached values are stored exactly, so a hit returns the
+// same bits that recomputing the result would.
+//
+// The cache is set-associative with RESULT_CACHE_WAYS entries per set. When a
+// set is full, its entries are replaced in round-robin order. Sets are
+// protected by a fixed number of striped locks, so threads only contend when
+// they access sets that share a lock.
+
+#define RESULT_CACHE_WAYS 4
+#define RESULT_CACHE_STRIPES 64
+
+typedef struct result_cache_key {
+    uint64_t hi;
+    uint64_t lo;
+} result_cache_key_t;
+
+typedef struct result_cache_entry {
+    result_cache_key_t key;
+    int valid;
+} result_cache_entry_t;
+
+typedef struct result_cache {
+    int num_values;
+    int num_sets;
+    result_cache_entry_t *entries;
+    double *values;
+    int *victims;
+    pthread_mutex_t locks[RESULT_CACHE_STRIPES];
+
+    // Bytes used by the entries, values and replacement state.
+    size_t bytes;
+
+    // Updated atomically by every lookup.
+    long hits;
+    long misses;
+} result_cache_t;
+
+// Creates a cache for num_values doubles per input that uses at most
+// max_bytes of memory, but always has at least one set.
+result_cache_t *make_result_cache(size_t max_bytes, int num_values);
+
+// Frees a cache.
+void free_result_cache(result_cache_t *cache);
+
+// Computes the fingerprint of an input volume.
+result_cache_key_t result_cache_fingerprint(volume_t *v);
+
+// Looks up the values of an input. On a hit, they are copied to values and 1
+// is returned, otherwise 0.
+int result_cache_lookup(result_cache_t *cache, result_cache_key_t key, double *values);
+
+// Stores the values of an input, replacing an older entry if needed.
+void result_cache_insert(result_cache_t *cache, result_cache_key_t key, const double *values);
+
+#endif
@@ -0,0 +1,160 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+// Include OpenMP
+#include <omp.h>
+
+#include "cifar.h"
+#include "memtrack.h"
+#include "network.h"
+#include "trace.h"
+#include "volume.h"
+
+// Place where test data is stored on instructional machines.
+const char *DATA_FOLDER = "/home/ff/cs61c/proj4/cifar-10-batches-bin";
+
+// Number of data files, 0 until num_batches counts them.
+static int data_batches = 0;
+
+int num_batches() {
+    if (data_batches == 0) {
+        char file_name[1024];
+        while (data_batches < MAX_BATCHES) {
+            sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, data_batches + 1);
+            if (access(file_name, R_OK) != 0) {
+                break;
+            }
+            data_batches++;
+        }
+        assert(data_batches > 0);
+    }
+    return data_batches;
+}
+
+int sample_batch(int sample_num) {
+    return (sample_num / 10000) % num_batches();
+}
+
+// Converts one 3073-byte cifar10 record (a label byte followed by the R, G and
+// B planes of a 32x32 image) into a 32x32x3 volume. The file stores each color
+// as its own plane while volumes interleave the color channels, so four pixels
+// of each plane are widened to doubles, normalized and then shuffled into
+// three interleaved vectors of r, g, b triples.
+//
+// The normalization is kept as a division followed by a subtraction (instead
+// of a single FMA with 1/255) so the result is bit-identical to the scalar
+// expression ((double)u)/255.0-0.5.
+void decode_sample(volume_t *v, const uint8_t *data) {
+    assert(v->width == 32 && v->height == 32 && v->depth == 3);
+
+    const uint8_t *red = data + 1;
+    const uint8_t *green = red + 32 * 32;
+    const uint8_t *blue = green + 32 * 32;
+    double *out = v->weights;
+
+#if defined(__AVX2__)
+    const __m256d scale = _mm256_set1_pd(255.0);
+    const __m256d offset = _mm256_set1_pd(0.5);
+
+    for (int p = 0; p < 32 * 32; p += 4) {
+        int32_t rbytes, gbytes, bbytes;
+        memcpy(&rbytes, red + p, 4);
+        memcpy(&gbytes, green + p, 4);
+        memcpy(&bbytes, blue + p, 4);
+
+        __m256d r = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(rbytes)));
+        __m256d g = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(gbytes)));
+        __m256d b = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bbytes)));
+        r = _mm256_sub_pd(_mm256_div_pd(r, scale), offset);
+        g = _mm256_sub_pd(_mm256_div_pd(g, scale), offset);
+        b = _mm256_sub_pd(_mm256_div_pd(b, scale), offset);
+
+        // Rotate the lanes so that every output vector needs exactly one lane
+        // from each permuted input:
+        //   out0 = r0 g0 b0 r1, out1 = g1 b1 r2 g2, out2 = b2 r3 g3 b3
+        __m256d rp = _mm256_permute4x64_pd(r, _MM_SHUFFLE(1, 2, 3, 0)); // r0 r3 r2 r1
+        __m256d gp = _mm256_permute4x64_pd(g, _MM_SHUFFLE(2, 3, 0, 1)); // g1 g0 g3 g2
+        __m256d bp = _mm256_permute4x64_pd(b, _MM_SHUFFLE(3, 0, 1, 2)); // b2 b1 b0 b3
+
+        __m256d out0 = _mm256_blend_pd(_mm256_blend_pd(rp, gp, 0x2), bp, 0x4);
+        __m256d out1 = _mm256_blend_pd(_mm256_blend_pd(gp, bp, 0x2), rp, 0x4);
+        __m256d out2 = _mm256_blend_pd(_mm256_blend_pd(bp, rp, 0x2), gp, 0x4);
+
+        _mm256_storeu_pd(out + p * 3, out0);
+        _mm256_storeu_pd(out + p * 3 + 4, out1);
+        _mm256_storeu_pd(out + p * 3 + 8, out2);
+    }
+#else
+    for (int p = 0; p < 32 * 32; p++) {
+        out[p * 3 + 0] = ((double)red[p])/255.0-0.5;
+        out[p * 3 + 1] = ((double)green[p])/255.0-0.5;
+        out[p * 3 + 2] = ((double)blue[p])/255.0-0.5;
+    }
+#endif
+}
+
+// Load an image from the cifar10 data set.
+void load_sample(volume_t *v, int sample_num) {
+    printf("Loading input sample %d...\n", sample_num);
+    uint64_t trace_start = trace_now();
+
+    int batch = sample_batch(sample_num);
+    int ix = sample_num % 10000;
+
+    char file_name[1024];
+    sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
+
+    FILE *fin = fopen(file_name, "rb");
+    assert(fin != NULL);
+
+    fseek(fin, ix * 3073, SEEK_SET);
+
+    uint8_t data[3073];
+    assert(fread(data, 1, 3073, fin) == 3073);
+
+    decode_sample(v, data);
+
+    fclose(fin);
+    trace_record("load_sample", "io", trace_start, 1);
+}
+
+// Load an entire batch of images from the cifar10 data set (which is divided
+// into 5 batches with 10,000 images each).
+batch_t load_batch(int batch) {
+    printf("Loading input batch %d...\n", batch);
+    uint64_t trace_start = trace_now();
+
+    char file_name[1024];
+    sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
+
+    FILE *fin = fopen(file_name, "rb");
+    assert(fin != NULL);
+    batch_t batchdata = malloc(sizeof(volume_t *) * 10000);
+
+    // Read the whole file at once, then decode the records in parallel.
+    uint8_t *data = malloc(3073 * 10000);
+    assert(fread(data, 1, 3073 * 10000, fin) == 3073 * 10000);
+    fclose(fin);
+
+#pragma omp parallel for
+    for (int i = 0; i < 10000; i++) {
+        batchdata[i] = make_volume_in(32, 32, 3, 0.0, MEM_DATASET);
+        decode_sample(batchdata[i], data + i * 3073);
+    }
+
+    free(data);
+    trace_record("load_batch", "io", trace_start, 10000);
+
+    return batchdata;
+}
@@ -0,0 +1,36 @@
+#ifndef CIFAR_H
+#define CIFAR_H
+
+#include <inttypes.h>
+
+#include "network.h"
+#include "volume.h"
+
+// Loaders for the binary version of the cifar10 data set. It is split into 5
+// files (data_batch_1.bin to data_batch_5.bin) of 10,000 records each. Every
+// record is 3073 bytes long: a label byte followed by the R, G and B planes of
+// a 32x32 image. A synthetic data set (see gen_cifar.c) can have up to
+// MAX_BATCHES files, and sample numbers past the last file wrap around to the
+// first one.
+
+#define MAX_BATCHES 50
+
+// Folder that contains the data files.
+extern const char *DATA_FOLDER;
+
+// Returns the number of data files in DATA_FOLDER (counted on the first call).
+int num_batches();
+
+// Returns the (0-based) data file that holds a sample.
+int sample_batch(int sample_num);
+
+// Converts one record into a 32x32x3 volume.
+void decode_sample(volume_t *v, const uint8_t *data);
+
+// Loads a single image of the data set.
+void load_sample(volume_t *v, int sample_num);
+
+// Loads all 10,000 images of one data file (batch is 0-based).
+batch_t load_batch(int batch);
+
+#endif
@@ -0,0 +1,136 @@
+#!/bin/bash
+
+# Compares the throughput of ./benchmark against ./benchmark_baseline, and
+# fails (exit code 1) if the outputs disagree with the references or if the
+# speedup falls below what is required.
+#
+# Both binaries run RUNS times, interleaved (ABBA order, so a drift of the
+# machine affects both the same way) and pinned to the CPUs in CPUS. Every run
+# classifies SIZE images. The result is the median throughput of each binary
+# with a 95% confidence interval of the mean, and the speedup of the medians.
+#
+# Settings (environment variables, or make variables for `make compare`):
+#   RUNS              runs per binary (default 5)
+#   SIZE              images per run (default 1200)
+#   CPUS              CPU list for taskset (default: all allowed CPUs)
+#   PARTEST_SIZES     partest references to check (default "100 400")
+#   REF_DIR           folder with the references (default test/ref, which
+#                     matches the real cifar10 data set)
+#   REQUIRED_SPEEDUP  speedup over the baseline that is expected (default 1)
+#   THRESHOLD         tolerated shortfall in percent (default 5)
+#   REFERENCE         file with an earlier median throughput of ./benchmark;
+#                     fail if the current one is more than THRESHOLD percent
+#                     lower (written instead if the file does not exist)
+
+RUNS=${RUNS:-5}
+SIZE=${SIZE:-1200}
+PARTEST_SIZES=${PARTEST_SIZES:-"100 400"}
+REF_DIR=${REF_DIR:-test/ref}
+REQUIRED_SPEEDUP=${REQUIRED_SPEEDUP:-1}
+THRESHOLD=${THRESHOLD:-5}
+
+for binary in benchmark benchmark_baseline; do
+    if [ ! -f "$binary" ]; then
+        echo "Need to run 'make' and 'make baseline' first!"
+        exit 2
+    fi
+done
+
+PIN=""
+if [ -n "$CPUS" ]; then
+    PIN="taskset -c $CPUS"
+fi
+# Keep every OpenMP thread on its own CPU.
+export OMP_PROC_BIND=${OMP_PROC_BIND:-close}
+export OMP_PLACES=${OMP_PLACES:-cores}
+
+FAILED=0
+
+# Output agreement of both binaries with the references.
+if [ ! -d "test/out" ]; then
+    mkdir test/out
+fi
+for binary in benchmark benchmark_baseline; do
+    for i in $PARTEST_SIZES; do
+        echo -n "PARALLEL TEST $i ($binary)... "
+        $PIN ./$binary partest $i 2>/dev/null | grep PAR > test/out/par$i.txt
+        if [ "$(wc -l < test/out/par$i.txt)" -ne "$i" ]; then
+            echo "ERROR: Expected $i outputs"
+            FAILED=1
+        elif ! python3 test/compare_output.py test/out/par$i.txt $REF_DIR/par$i.txt; then
+            FAILED=1
+        fi
+    done
+done
+
+# Prints the throughput (images/s) of one run of a binary.
+run() {
+    $PIN ./$1 benchmark $SIZE 2>/dev/null | awk -v n=$SIZE '/ microseconds$/ { us = $1 } END { print n * 1e6 / us }'
+}
+
+: > /tmp/compare_benchmark.$$
+: > /tmp/compare_baseline.$$
+for ((r = 0; r < RUNS; r++)); do
+    echo "Run $((r + 1)) of $RUNS..."
+    if [ $((r % 2)) -eq 0 ]; then
+        run benchmark >> /tmp/compare_benchmark.$$
+        run benchmark_baseline >> /tmp/compare_baseline.$$
+    else
+        run benchmark_baseline >> /tmp/compare_baseline.$$
+        run benchmark >> /tmp/compare_benchmark.$$
+    fi
+done
+
+# Prints the median, the mean and the half width of the 95% confidence
+# interval of the mean (Student's t) of the numbers in a file.
+stats() {
+    sort -g "$1" | awk '
+        { x[NR] = $1; sum += $1 }
+        END {
+            n = NR
+            median = n % 2 ? x[(n + 1) / 2] : (x[n / 2] + x[n / 2 + 1]) / 2
+            mean = sum / n
+            for (i = 1; i <= n; i++) ss += (x[i] - mean) ^ 2
+            split("12.71 4.30 3.18 2.78 2.57 2.45 2.36 2.31 2.26 2.23 2.20 2.18 2.16 2.14 2.13 " \
+                  "2.12 2.11 2.10 2.09 2.09 2.08 2.07 2.07 2.06 2.06 2.06 2.05 2.05 2.05 2.04", t, " ")
+            half = n > 1 ? (n - 1 <= 30 ? t[n - 1] : 1.96) * sqrt(ss / (n - 1) / n) : 0
+            printf "%.1f %.1f %.1f\n", median, mean, half
+        }'
+}
+
+read OPT_MEDIAN OPT_MEAN OPT_CI < <(stats /tmp/compare_benchmark.$$)
+read BASE_MEDIAN BASE_MEAN BASE_CI < <(stats /tmp/compare_baseline.$$)
+rm -f /tmp/compare_benchmark.$$ /tmp/compare_baseline.$$
+
+echo
+echo "benchmark:          median $OPT_MEDIAN images/s (mean $OPT_MEAN +- $OPT_CI)"
+echo "benchmark_baseline: median $BASE_MEDIAN images/s (mean $BASE_MEAN +- $BASE_CI)"
+
+SPEEDUP=$(awk -v a=$OPT_MEDIAN -v b=$BASE_MEDIAN 'BEGIN { printf "%.2f", a / b }')
+echo "Speedup: ${SPEEDUP}x"
+
+if awk -v s=$SPEEDUP -v r=$REQUIRED_SPEEDUP -v t=$THRESHOLD 'BEGIN { exit !(s < r * (1 - t / 100)) }'; then
+    echo "ERROR: Speedup below ${REQUIRED_SPEEDUP}x (by more than $THRESHOLD%)"
+    FAILED=1
+fi
+
+if [ -n "$REFERENCE" ]; then
+    if [ -f "$REFERENCE" ]; then
+        PREVIOUS=$(cat "$REFERENCE")
+        echo "Reference: $PREVIOUS images/s"
+        if awk -v c=$OPT_MEDIAN -v p=$PREVIOUS -v t=$THRESHOLD 'BEGIN { exit !(c < p * (1 - t / 100)) }'; then
+            echo "ERROR: Throughput regressed by more than $THRESHOLD% against $REFERENCE"
+            FAILED=1
+        fi
+    else
+        echo "$OPT_MEDIAN" > "$REFERENCE"
+        echo "Reference written to $REFERENCE"
+    fi
+fi
+
+echo
+if [ "$FAILED" -ne 0 ]; then
+    echo "COMPARISON FAILED"
+    exit 1
+fi
+echo "COMPARISON PASSED"
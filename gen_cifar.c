@@ -0,0 +1,92 @@
+// Writes a synthetic data set in the binary cifar10 format, so that the
+// benchmarks can run on machines without the real data set, and on data sets
+// larger than the real one (which has 5 files).
+//
+// Usage: ./gen_cifar <folder> [num_batches] [seed]
+//
+// Creates data_batch_1.bin to data_batch_<num_batches>.bin in folder, each
+// with 10,000 records of 3073 bytes: a random label byte (0 to 9) followed by
+// 3072 random pixel bytes. The contents only depend on the seed (and the index
+// of the file), not on the platform or on the C library.
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "network.h"
+
+const int DEFAULT_NUM_BATCHES = 5;
+const uint64_t DEFAULT_SEED = 61;
+const int RECORDS_PER_BATCH = 10000;
+const int RECORD_SIZE = 3073;
+
+// splitmix64, so that the same seed gives the same files everywhere.
+uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Fills one record: a label followed by the R, G and B planes.
+void make_record(uint8_t *record, uint64_t *state) {
+    record[0] = (uint8_t) (next_random(state) % NUM_CLASSES);
+    for (int i = 1; i < RECORD_SIZE; i += 8) {
+        uint64_t bits = next_random(state);
+        for (int j = i; j < i + 8 && j < RECORD_SIZE; j++) {
+            record[j] = (uint8_t) bits;
+            bits >>= 8;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: ./gen_cifar <folder> [num_batches] [seed]\n");
+        return 2;
+    }
+
+    const char *folder = argv[1];
+    int num_batches = DEFAULT_NUM_BATCHES;
+    uint64_t seed = DEFAULT_SEED;
+    if (argc > 2)
+        num_batches = atoi(argv[2]);
+    if (argc > 3)
+        seed = strtoull(argv[3], NULL, 10);
+
+    // load_inputs in benchmark.c keeps at most 50 batches.
+    assert(num_batches > 0 && num_batches <= 50);
+
+    if (mkdir(folder, 0755) != 0 && errno != EEXIST) {
+        printf("ERROR: Cannot create %s\n", folder);
+        return 1;
+    }
+
+    uint8_t *data = (uint8_t *) malloc((size_t) RECORD_SIZE * RECORDS_PER_BATCH);
+    for (int batch = 0; batch < num_batches; batch++) {
+        // Every file has its own stream, so a file does not change when more
+        // files are generated.
+        uint64_t state = seed * 0x100000001b3ULL + batch;
+        for (int r = 0; r < RECORDS_PER_BATCH; r++) {
+            make_record(data + (size_t) r * RECORD_SIZE, &state);
+        }
+
+        char file_name[1024];
+        snprintf(file_name, sizeof(file_name), "%s/data_batch_%d.bin", folder, batch + 1);
+        printf("Writing %s...\n", file_name);
+
+        FILE *fout = fopen(file_name, "wb");
+        if (fout == NULL) {
+            printf("ERROR: Cannot open %s\n", file_name);
+            return 1;
+        }
+        assert(fwrite(data, RECORD_SIZE, RECORDS_PER_BATCH, fout) == RECORDS_PER_BATCH);
+        fclose(fout);
+    }
+    free(data);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Needed for clock_gettime.
+#define _GNU_SOURCE
+
+#include <time.h>
+
+#include "instrument.h"
+#include "latency.h"
+#include "network.h"
+#include "profile.h"
+#include "trace.h"
+
+int instrument_flags = 0;
+
+static const char *layer_names[NUM_LAYERS] = {
+    "conv0", "relu1", "pool2", "conv3", "relu4", "pool5", "conv6", "relu7", "pool8", "fc9", "softmax10",
+};
+
+static const char *pass_names[LATENCY_NUM_KINDS] = {"image", "batch", "parallel", "pipeline"};
+
+void instrument_set(int flag, int enabled) {
+    if (enabled) {
+        __atomic_fetch_or(&instrument_flags, flag, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&instrument_flags, ~flag, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t instrument_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void instrument_forward(network_t *net, batch_t *b, int start, int end) {
+    int flags = instrument_flags;
+    int images = end - start + 1;
+    uint64_t begin = flags & (INSTRUMENT_LATENCY | INSTRUMENT_TRACE) ? instrument_now() : 0;
+
+    if (flags & (INSTRUMENT_PROFILE | INSTRUMENT_TRACE)) {
+        for (int l = 0; l < NUM_LAYERS; l++) {
+            profile_stamp_t stamp;
+            uint64_t layer_begin = 0;
+            if (flags & INSTRUMENT_PROFILE) {
+                stamp = profile_start();
+            }
+            if (flags & INSTRUMENT_TRACE) {
+                layer_begin = instrument_now();
+            }
+
+            net_forward_layers(net, b, l, l + 1, start, end);
+
+            if (flags & INSTRUMENT_TRACE) {
+                trace_record(layer_names[l], "layer", layer_begin, images);
+            }
+            if (flags & INSTRUMENT_PROFILE) {
+                profile_stop(l, stamp, images);
+            }
+        }
+    } else {
+        net_forward_layers(net, b, 0, NUM_LAYERS, start, end);
+    }
+
+    if (flags & (INSTRUMENT_LATENCY | INSTRUMENT_TRACE)) {
+        instrument_pass(begin, start == end ? LATENCY_IMAGE : LATENCY_BATCH, images);
+    }
+}
+
+void instrument_pass(uint64_t begin, int kind, int images) {
+    int flags = instrument_flags;
+    if (flags & INSTRUMENT_LATENCY) {
+        latency_add(instrument_now() - begin, kind);
+    }
+    if (flags & INSTRUMENT_TRACE) {
+        trace_record(pass_names[kind], "forward", begin, images);
+    }
+}
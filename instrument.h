@@ -0,0 +1,38 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <inttypes.h>
+
+#include "network.h"
+
+// Instrumentation of net_forward: per-layer profiling (profile.h), latency
+// histograms (latency.h) and the trace timeline (trace.h). Each of them sets
+// its flag in instrument_flags while it is enabled, so while all of them are
+// off (the default), net_forward only pays for a single branch on one word.
+
+#define INSTRUMENT_PROFILE 1
+#define INSTRUMENT_LATENCY 2
+#define INSTRUMENT_TRACE 4
+
+// Nonzero while any instrumentation is enabled (read only, see
+// instrument_set).
+extern int instrument_flags;
+
+// Sets or clears one of the flags.
+void instrument_set(int flag, int enabled);
+
+// Returns the time of the monotonic clock in nanoseconds.
+uint64_t instrument_now(void);
+
+// Same as net_forward, but with every enabled instrumentation. Called by
+// net_forward while instrument_flags is nonzero.
+void instrument_forward(network_t *net, batch_t *b, int start, int end);
+
+// Records a whole forward pass of the given kind (see latency.h) over images
+// images that started at begin (from instrument_now): in the latency
+// histograms and on the trace timeline, if they are enabled. Called by the
+// forward paths that do not go through net_forward as a whole (intra-image
+// parallel, pipeline) and around the batches of the server.
+void instrument_pass(uint64_t begin, int kind, int images);
+
+#endif
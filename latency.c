@@ -0,0 +1,148 @@
+// Needed for posix_memalign.
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "instrument.h"
+#include "latency.h"
+
+int latency_enabled = 0;
+
+static int phase = LATENCY_STEADY;
+
+// Per-thread histograms.
+typedef struct latency_counters {
+    latency_histogram_t histograms[LATENCY_NUM_PHASES][LATENCY_NUM_KINDS];
+    struct latency_counters *next;
+} latency_counters_t;
+
+// The histograms of all threads that have ever recorded anything. They are
+// kept after the thread exits, so they can still be reported.
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static latency_counters_t *all_counters = NULL;
+static __thread latency_counters_t *thread_counters = NULL;
+
+static latency_counters_t *local_counters(void) {
+    if (thread_counters == NULL) {
+        // Cache line aligned, so the histograms of different threads never
+        // share a line.
+        void *memory;
+        if (posix_memalign(&memory, 64, sizeof(latency_counters_t)) != 0) {
+            abort();
+        }
+        thread_counters = (latency_counters_t *) memory;
+        memset(thread_counters, 0, sizeof(latency_counters_t));
+
+        pthread_mutex_lock(&counters_lock);
+        thread_counters->next = all_counters;
+        all_counters = thread_counters;
+        pthread_mutex_unlock(&counters_lock);
+    }
+    return thread_counters;
+}
+
+void latency_enable(int enabled) {
+    latency_enabled = enabled;
+    instrument_set(INSTRUMENT_LATENCY, enabled);
+}
+
+void latency_set_phase(int p) {
+    __atomic_store_n(&phase, p, __ATOMIC_RELAXED);
+}
+
+void latency_reset(void) {
+    pthread_mutex_lock(&counters_lock);
+    for (latency_counters_t *c = all_counters; c != NULL; c = c->next) {
+        memset(c->histograms, 0, sizeof(c->histograms));
+    }
+    pthread_mutex_unlock(&counters_lock);
+}
+
+static int bucket_index(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (int) ns;
+    }
+    // Keep the LATENCY_SUB_BITS most significant bits.
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS + 1;
+    return shift * LATENCY_HALF + (int) (ns >> shift);
+}
+
+// Returns the largest value that falls into bucket index.
+static uint64_t bucket_end(int index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / LATENCY_HALF - 1;
+    uint64_t top = index - shift * LATENCY_HALF;
+    return ((top + 1) << shift) - 1;
+}
+
+void latency_record(latency_histogram_t *h, uint64_t ns) {
+    h->count++;
+    h->sum_ns += ns;
+    h->max_ns = ns > h->max_ns ? ns : h->max_ns;
+    h->buckets[bucket_index(ns)]++;
+}
+
+void latency_merge(latency_histogram_t *to, latency_histogram_t *from) {
+    to->count += from->count;
+    to->sum_ns += from->sum_ns;
+    to->max_ns = from->max_ns > to->max_ns ? from->max_ns : to->max_ns;
+    for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+}
+
+uint64_t latency_percentile(latency_histogram_t *h, double p) {
+    // The rank of the value, counting from 1.
+    uint64_t rank = (uint64_t) (p / 100 * h->count + 0.999999);
+    rank = rank < 1 ? 1 : rank;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t end = bucket_end(i);
+            return end < h->max_ns ? end : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+void latency_add(uint64_t ns, int kind) {
+    latency_counters_t *c = local_counters();
+    int p = __atomic_load_n(&phase, __ATOMIC_RELAXED);
+    latency_record(&c->histograms[p][kind], ns);
+}
+
+void latency_report(void) {
+    static const char *phase_names[LATENCY_NUM_PHASES] = {"warmup", "steady"};
+    static const char *kind_names[LATENCY_NUM_KINDS] = {"image", "batch", "parallel", "pipeline"};
+
+    printf("%-8s %-8s %10s %10s %10s %10s %10s %10s %10s\n", "PHASE", "KIND", "COUNT", "MEAN(us)", "P50(us)",
+           "P90(us)", "P99(us)", "P99.9(us)", "MAX(us)");
+
+    latency_histogram_t *h = (latency_histogram_t *) malloc(sizeof(latency_histogram_t));
+    for (int p = 0; p < LATENCY_NUM_PHASES; p++) {
+        for (int k = 0; k < LATENCY_NUM_KINDS; k++) {
+            memset(h, 0, sizeof(latency_histogram_t));
+            pthread_mutex_lock(&counters_lock);
+            for (latency_counters_t *c = all_counters; c != NULL; c = c->next) {
+                latency_merge(h, &c->histograms[p][k]);
+            }
+            pthread_mutex_unlock(&counters_lock);
+
+            if (h->count == 0) {
+                continue;
+            }
+            printf("%-8s %-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[p], kind_names[k],
+                   h->count, h->sum_ns * 1e-3 / h->count, latency_percentile(h, 50) * 1e-3,
+                   latency_percentile(h, 90) * 1e-3, latency_percentile(h, 99) * 1e-3,
+                   latency_percentile(h, 99.9) * 1e-3, h->max_ns * 1e-3);
+        }
+    }
+    free(h);
+}
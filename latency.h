@@ -0,0 +1,76 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <inttypes.h>
+
+// Optional latency recording of forward passes. While it is enabled, every
+// pass is timed with the monotonic clock, and its duration is added to a
+// histogram of the calling thread, one per kind of pass: net_forward for a
+// single image, a batch of images (net_forward for several images, or a whole
+// batch of the server), net_forward_parallel (one image on a team of threads)
+// and one image through all stages of a pipeline. The recordings are split into
+// a warmup and a steady state phase, so the first (cold) passes do not distort
+// the tail. While it is disabled (the default), the forward paths only pay for
+// a single branch.
+//
+// The histograms work like HdrHistogram: there is a bucket for every value
+// below LATENCY_SUB_BUCKETS nanoseconds, and above that LATENCY_HALF buckets
+// for every power of two, so no bucket is wider than 1/64th of its values.
+
+#define LATENCY_SUB_BITS 7
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_HALF (LATENCY_SUB_BUCKETS / 2)
+#define LATENCY_NUM_BUCKETS ((64 - LATENCY_SUB_BITS + 2) * LATENCY_HALF)
+
+// Phases.
+#define LATENCY_WARMUP 0
+#define LATENCY_STEADY 1
+#define LATENCY_NUM_PHASES 2
+
+// Kinds of forward passes.
+#define LATENCY_IMAGE 0
+#define LATENCY_BATCH 1
+#define LATENCY_PARALLEL 2
+#define LATENCY_PIPELINE 3
+#define LATENCY_NUM_KINDS 4
+
+typedef struct latency_histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_NUM_BUCKETS];
+} latency_histogram_t;
+
+// Nonzero while recording is enabled (read only, see latency_enable).
+extern int latency_enabled;
+
+// Turns recording on or off.
+void latency_enable(int enabled);
+
+// Sets the phase that calls are recorded in from now on (LATENCY_STEADY by
+// default).
+void latency_set_phase(int phase);
+
+// Clears the histograms of all threads.
+void latency_reset(void);
+
+// Adds a duration (in nanoseconds) to h.
+void latency_record(latency_histogram_t *h, uint64_t ns);
+
+// Adds the counts of from to to.
+void latency_merge(latency_histogram_t *to, latency_histogram_t *from);
+
+// Returns the duration that p percent of the recorded values do not exceed
+// (rounded up to the end of its bucket, but never above the maximum).
+uint64_t latency_percentile(latency_histogram_t *h, double p);
+
+// Adds the duration of a forward pass of the given kind to the histogram of
+// the calling thread for the current phase. Called by instrument_pass while
+// recording is enabled.
+void latency_add(uint64_t ns, int kind);
+
+// Prints the count, mean, p50, p90, p99, p99.9 and maximum of every phase and
+// kind that has recordings, merged over all threads.
+void latency_report(void);
+
+#endif
@@ -15,6 +15,8 @@
 #include <omp.h>
 
 #include "layers.h"
+#include "memtrack.h"
+#include "parse.h"
 #include "volume.h"
 
 conv_layer_t *make_conv_layer(int input_width, int input_height, int input_depth, int filter_width, int num_filters,
@@ -38,12 +40,12 @@ conv_layer_t *make_conv_layer(int input_width, int input_height, int input_depth
 
     l->filters = malloc(sizeof(volume_t *) * num_filters);
     for (int i = 0; i < num_filters; i++) {
-        l->filters[i] = make_volume(filter_width, l->filter_height,
-                                    input_depth, 0.0);
+        l->filters[i] = make_volume_in(filter_width, l->filter_height,
+                                       input_depth, 0.0, MEM_WEIGHTS);
     }
 
     l->bias = 0.0;
-    l->biases = make_volume(1, 1, l->output_depth, l->bias);
+    l->biases = make_volume_in(1, 1, l->output_depth, l->bias, MEM_WEIGHTS);
 
     return l;
 }
@@ -84,43 +86,40 @@ conv_layer_t *make_conv_layer(int input_width, int input_height, int input_depth
 // arrays, we must use the volume_get and volume_set commands to access elements
 // at a coordinate (x, y, d). Finally, we add the corresponding bias for the
 // filter to the sum before putting it into the output volume.
-void conv_forward(conv_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end) {
-    for (int i = start; i <= end; i++) {
-        volume_t *in = inputs[i];
-        volume_t *out = outputs[i];
-        int out_width = out->width;
-        double* out_weights = out->weights;
-        int out_depth = out->depth;
-
-        int in_width = in->width;
-        double* in_weights = in->weights;
-        int in_depth = in->depth;
-        int in_height = in->height;
-
-        int stride = l->stride;
-
-        for (int f = 0; f < l->output_depth; f++) {
-            volume_t *filter = l->filters[f];
-            double* f_weights = filter->weights;
-            int f_width = filter->width;
-            int f_depth = filter->depth;
-            int f_height = filter->height;
-            int y = -l->pad;
-            for (int out_y = 0; out_y < l->output_height; y += l->stride, out_y++) {
-                int x = -l->pad;
-                for (int out_x = 0; out_x < l->output_width; x += l->stride, out_x++) {
-                    // Take sum of element-wise product
-                    double sum = 0.0;
-
-                    double sarray[4];
-                    __m256d result = _mm256_setzero_pd();
-
-                    for (int fy = 0; fy < f_height; fy++) {
-                        int in_y = y + fy;
-                        for (int fx = 0; fx < f_width; fx++) {
-                            int in_x = x + fx;
-                            if (in_y >= 0 && in_y < in_height && in_x >= 0 && in_x < in_width) {
-                                //original
+void conv_forward_part(conv_layer_t *l, volume_t *in, volume_t *out, int f_start, int f_end, int y_start, int y_end) {
+    int out_width = out->width;
+    double* out_weights = out->weights;
+    int out_depth = out->depth;
+
+    int in_width = in->width;
+    double* in_weights = in->weights;
+    int in_depth = in->depth;
+    int in_height = in->height;
+
+    int stride = l->stride;
+
+    for (int f = f_start; f < f_end; f++) {
+        volume_t *filter = l->filters[f];
+        double* f_weights = filter->weights;
+        int f_width = filter->width;
+        int f_depth = filter->depth;
+        int f_height = filter->height;
+        int y = -l->pad + y_start * stride;
+        for (int out_y = y_start; out_y < y_end; y += l->stride, out_y++) {
+            int x = -l->pad;
+            for (int out_x = 0; out_x < l->output_width; x += l->stride, out_x++) {
+                // Take sum of element-wise product
+                double sum = 0.0;
+
+                double sarray[4];
+                __m256d result = _mm256_setzero_pd();
+
+                for (int fy = 0; fy < f_height; fy++) {
+                    int in_y = y + fy;
+                    for (int fx = 0; fx < f_width; fx++) {
+                        int in_x = x + fx;
+                        if (in_y >= 0 && in_y < in_height && in_x >= 0 && in_x < in_width) {
+                            //original
 //                                    for (int fd = 0; fd < filter->depth; fd++) {
 //                                        sum += volume_get(filter, fx, fy, fd) * volume_get(in, in_x, in_y, fd);
 //                                    }
@@ -128,128 +127,132 @@ void conv_forward(conv_layer_t *l, volume_t **inputs, volume_t **outputs, int st
 //                                double sarray[4];
 //                                __m256d result = _mm256_setzero_pd();
 
-                                if (filter->depth == 3){
-                                    __m256d a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 0));
-                                    __m256d b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 0));
-                                    __m256d c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
+                            if (filter->depth == 3){
+                                __m256d a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 0));
+                                __m256d b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 0));
+                                __m256d c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
 
 //                                    _mm256_storeu_pd(sarray, result);
 //                                    sum += sarray[0] + sarray[1] + sarray[2];
 
-                                }
-                                else if (filter->depth == 16){
-                                    __m256d a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 0));
-                                    __m256d b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 0));
-                                    __m256d c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
-
-                                    a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 4));
-                                    b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 4));
-                                    c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
-
-                                    a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 8));
-                                    b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 8));
-                                    c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
-
-                                    a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 12));
-                                    b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 12));
-                                    c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
+                            }
+                            else if (filter->depth == 16){
+                                __m256d a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 0));
+                                __m256d b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 0));
+                                __m256d c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
+
+                                a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 4));
+                                b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 4));
+                                c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
+
+                                a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 8));
+                                b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 8));
+                                c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
+
+                                a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 12));
+                                b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 12));
+                                c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
 
 //                                    _mm256_storeu_pd(sarray, result);
 //                                    sum += sarray[0] + sarray[1] + sarray[2]+sarray[3];
-                                }
-                                else if (filter->depth == 20){
-                                    __m256d a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 0));
-                                    __m256d b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 0));
-                                    __m256d c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
-
-                                    a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 4));
-                                    b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 4));
-                                    c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
-
-                                    a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 8));
-                                    b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 8));
-                                    c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
-
-                                    a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 12));
-                                    b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 12));
-                                    c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
-
-                                    a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 16));
-                                    b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 16));
-                                    c = _mm256_mul_pd(a, b);
-                                    result = _mm256_add_pd(result, c);
+                            }
+                            else if (filter->depth == 20){
+                                __m256d a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 0));
+                                __m256d b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 0));
+                                __m256d c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
+
+                                a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 4));
+                                b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 4));
+                                c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
+
+                                a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 8));
+                                b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 8));
+                                c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
+
+                                a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 12));
+                                b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 12));
+                                c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
+
+                                a = _mm256_loadu_pd(in_weights+(((in_width * in_y) + in_x) * in_depth + 16));
+                                b = _mm256_loadu_pd(f_weights+(((f_width * fy) + fx) * f_depth + 16));
+                                c = _mm256_mul_pd(a, b);
+                                result = _mm256_add_pd(result, c);
 
 //                                    _mm256_storeu_pd(sarray, result);
 //                                    sum += sarray[0] + sarray[1] + sarray[2]+sarray[3];
-                                }
                             }
                         }
                     }
+                }
 
-                    if (filter->depth == 3) {
-                        _mm256_storeu_pd(sarray, result);
-                        sum += sarray[0] + sarray[1] + sarray[2];
-                    } else {
-                        _mm256_storeu_pd(sarray, result);
-                        sum += sarray[0] + sarray[1] + sarray[2]+sarray[3];
-                    }
+                if (filter->depth == 3) {
+                    _mm256_storeu_pd(sarray, result);
+                    sum += sarray[0] + sarray[1] + sarray[2];
+                } else {
+                    _mm256_storeu_pd(sarray, result);
+                    sum += sarray[0] + sarray[1] + sarray[2]+sarray[3];
+                }
 //                    double* res = (double*) calloc(4, sizeof(double));
 //                    _mm256_storeu_pd(res, result);
 //                    sum += res[0] + res[1] + res[2] + res[3];
 //                    free(res);
 
-                    sum += l->biases->weights[f];
-                    //volume_set(out, out_x, out_y, f, sum);
-                    out_weights[((out_width * out_y) + out_x) * out_depth + f] = sum;
-                }
+                sum += l->biases->weights[f];
+                //volume_set(out, out_x, out_y, f, sum);
+                out_weights[((out_width * out_y) + out_x) * out_depth + f] = sum;
             }
         }
     }
 }
 
-void conv_load(conv_layer_t *l, const char *file_name) {
-    int filter_width, filter_height, depth, filters;
-
-    FILE *fin = fopen(file_name, "r");
+void conv_forward(conv_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end) {
+    for (int i = start; i <= end; i++) {
+        conv_forward_part(l, inputs[i], outputs[i], 0, l->output_depth, 0, l->output_height);
+    }
+}
 
-    fscanf(fin, "%d %d %d %d", &filter_width, &filter_height, &depth, &filters);
+void conv_load(conv_layer_t *l, const char *file_name) {
+    int header[4];
+    int count;
+    double *values = parse_number_file(file_name, header, 4, &count);
+
+    int filter_width = header[0];
+    int filter_height = header[1];
+    int depth = header[2];
+    int filters = header[3];
     assert(filter_width == l->filter_width);
     assert(filter_height == l->filter_height);
     assert(depth == l->input_depth);
     assert(filters == l->output_depth);
+    assert(count == filters * filter_width * filter_height * depth + l->output_depth);
 
+    int v = 0;
     for(int f = 0; f < filters; f++) {
         double* weights = l->filters[f]->weights;
-        int depth = l->filters[f]->depth;
         int width = l->filters[f]->width;
         for (int x = 0; x < filter_width; x++) {
             for (int y = 0; y < filter_height; y++) {
                 for (int d = 0; d < depth; d++) {
-                    double val;
-                    fscanf(fin, "%lf", &val);
-                    //volume_set(l->filters[f], x, y, d, val);
-                    weights[((width * y) + x) * depth + d] = val;
+                    weights[((width * y) + x) * depth + d] = values[v++];
                 }
             }
         }
     }
 
     for(int d = 0; d < l->output_depth; d++) {
-        double val;
-        fscanf(fin, "%lf", &val);
-        volume_set(l->biases, 0, 0, d, val);
+        volume_set(l->biases, 0, 0, d, values[v++]);
     }
 
-    fclose(fin);
+    free(values);
 }
 
 relu_layer_t *make_relu_layer(int input_width, int input_height, int input_depth) {
@@ -268,33 +271,37 @@ relu_layer_t *make_relu_layer(int input_width, int input_height, int input_depth
 
 // Applies the Rectifier Linear Unit (ReLU) function to the input, which sets
 // output(x, y, d) to max(0.0, input(x, y, d)).
-void relu_forward(relu_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end) {
+void relu_forward_rows(relu_layer_t *l, volume_t *in, volume_t *out, int y_start, int y_end) {
     int width = l->input_width;
-    int height = l->input_height;
     int depth = l->input_depth;
-    for (int i = start; i <= end; i++) {
-        double * input_weights = inputs[i]->weights;
-        int input_width = inputs[i]->width;
-        int input_depth = inputs[i]->depth;
-
-        double * output_weights = outputs[i]->weights;
-        int output_width = outputs[i]->width;
-        int output_depth = outputs[i]->depth;
 
-        for (int x = 0; x < width; x++) {
-            for (int y = 0; y < height; y++) {
-                for (int d = 0; d < depth; d++) {
-                    double v = input_weights[((input_width * y) + x) * input_depth + d];
-                    //double v = volume_get(inputs[i], x, y, d);
-                    double value = (v < 0.0) ? 0.0 : v;
-                    //volume_set(outputs[i], x, y, d, value);
-                    output_weights[((output_width * y) + x) * output_depth + d] = value;
-                }
+    double * input_weights = in->weights;
+    int input_width = in->width;
+    int input_depth = in->depth;
+
+    double * output_weights = out->weights;
+    int output_width = out->width;
+    int output_depth = out->depth;
+
+    for (int x = 0; x < width; x++) {
+        for (int y = y_start; y < y_end; y++) {
+            for (int d = 0; d < depth; d++) {
+                double v = input_weights[((input_width * y) + x) * input_depth + d];
+                //double v = volume_get(inputs[i], x, y, d);
+                double value = (v < 0.0) ? 0.0 : v;
+                //volume_set(outputs[i], x, y, d, value);
+                output_weights[((output_width * y) + x) * output_depth + d] = value;
             }
         }
     }
 }
 
+void relu_forward(relu_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end) {
+    for (int i = start; i <= end; i++) {
+        relu_forward_rows(l, inputs[i], outputs[i], 0, l->input_height);
+    }
+}
+
 pool_layer_t *make_pool_layer(int input_width, int input_height, int input_depth, int pool_width, int stride) {
     pool_layer_t *l = (pool_layer_t *) malloc(sizeof(pool_layer_t));
 
@@ -326,59 +333,60 @@ pool_layer_t *make_pool_layer(int input_width, int input_height, int input_depth
 //
 // then the value of the corresponding element in the output is 5 (since that
 // is the maximum element). This effectively compresses the input.
-void pool_forward(pool_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end) {
-    for (int i = start; i <= end; i++) {
-        volume_t *in = inputs[i];
-        volume_t *out = outputs[i];
-        double* in_weights = in->weights;
-        int in_height = in->height;
-        int in_width = in->width;
-        int in_depth = in->depth;
-        int output_depth = l->output_depth;
-        int output_width = l->output_width;
-        int output_height = l->output_height;
-        int stride = l->stride;
-        int pad = l->pad;
-        int pool_width = l->pool_width;
-        int pool_height = l->pool_height;
-
-        double* out_weights = out->weights;
-        int out_width = out->width;
-        int out_depth = out->depth;
-
-
-        int n = 0;
-        for(int d = 0; d < output_depth; d++) {
-            int x = -pad;
-            for(int out_x = 0; out_x < output_width; x += stride, out_x++) {
-                int y = -pad;
-                for(int out_y = 0; out_y < output_height; y += stride, out_y++) {
-
-                    double max = -INFINITY;
-                    for(int fx = 0; fx < pool_width; fx++) {
-                        for(int fy = 0; fy < pool_height; fy++) {
-                            int in_y = y + fy;
-                            int in_x = x + fx;
-                            if(in_x >= 0 && in_x < in_width && in_y >= 0 && in_y < in_height) {
-                                double v = in_weights[((in_width * in_y) + in_x) * in_depth + d];
-                                //double v = volume_get(in, in_x, in_y, d);
-                                if(v > max) {
-                                    max = v;
-                                }
+void pool_forward_rows(pool_layer_t *l, volume_t *in, volume_t *out, int y_start, int y_end) {
+    double* in_weights = in->weights;
+    int in_height = in->height;
+    int in_width = in->width;
+    int in_depth = in->depth;
+    int output_depth = l->output_depth;
+    int output_width = l->output_width;
+    int stride = l->stride;
+    int pad = l->pad;
+    int pool_width = l->pool_width;
+    int pool_height = l->pool_height;
+
+    double* out_weights = out->weights;
+    int out_width = out->width;
+    int out_depth = out->depth;
+
+
+    int n = 0;
+    for(int d = 0; d < output_depth; d++) {
+        int x = -pad;
+        for(int out_x = 0; out_x < output_width; x += stride, out_x++) {
+            int y = -pad + y_start * stride;
+            for(int out_y = y_start; out_y < y_end; y += stride, out_y++) {
+
+                double max = -INFINITY;
+                for(int fx = 0; fx < pool_width; fx++) {
+                    for(int fy = 0; fy < pool_height; fy++) {
+                        int in_y = y + fy;
+                        int in_x = x + fx;
+                        if(in_x >= 0 && in_x < in_width && in_y >= 0 && in_y < in_height) {
+                            double v = in_weights[((in_width * in_y) + in_x) * in_depth + d];
+                            //double v = volume_get(in, in_x, in_y, d);
+                            if(v > max) {
+                                max = v;
                             }
                         }
                     }
+                }
 
-                    n++;
-                    //volume_set(out, out_x, out_y, d, max);
-                    out_weights[((out_width * out_y) + out_x) * out_depth + d] = max;
+                n++;
+                //volume_set(out, out_x, out_y, d, max);
+                out_weights[((out_width * out_y) + out_x) * out_depth + d] = max;
 
-                }
             }
         }
     }
 }
 
+void pool_forward(pool_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end) {
+    for (int i = start; i <= end; i++) {
+        pool_forward_rows(l, inputs[i], outputs[i], 0, l->output_height);
+    }
+}
+
 fc_layer_t *make_fc_layer(int input_width, int input_height, int input_depth, int num_neurons) {
     fc_layer_t *l = (fc_layer_t *) malloc(sizeof(fc_layer_t));
 
@@ -393,11 +401,11 @@ fc_layer_t *make_fc_layer(int input_width, int input_height, int input_depth, in
 
     l->filters = (volume_t **) malloc(sizeof(volume_t *) * num_neurons);
     for (int i = 0; i < l->output_depth; i++) {
-        l->filters[i] = make_volume(1, 1, l->num_inputs, 0.0);
+        l->filters[i] = make_volume_in(1, 1, l->num_inputs, 0.0, MEM_WEIGHTS);
     }
 
     l->bias = 0.0;
-    l->biases = make_volume(1, 1, l->output_depth, l->bias);
+    l->biases = make_volume_in(1, 1, l->output_depth, l->bias, MEM_WEIGHTS);
 
     return l;
 }
@@ -438,24 +446,27 @@ void fc_forward(fc_layer_t *l, volume_t **inputs, volume_t **outputs, int start,
 
 
 void fc_load(fc_layer_t *l, const char *filename) {
-    FILE *fin = fopen(filename, "r");
+    int header[2];
+    int count;
+    double *values = parse_number_file(filename, header, 2, &count);
 
-    int num_inputs;
-    int output_depth;
-    fscanf(fin, "%d %d", &num_inputs, &output_depth);
+    int num_inputs = header[0];
+    int output_depth = header[1];
     assert(output_depth == l->output_depth);
     assert(num_inputs == l->num_inputs);
+    assert(count == output_depth * num_inputs + output_depth);
 
+    int v = 0;
     for(int i = 0; i < l->output_depth; i++)
         for(int j = 0; j < l->num_inputs; j++) {
-            fscanf(fin, "%lf", &(l->filters[i]->weights[j]));
+            l->filters[i]->weights[j] = values[v++];
         }
 
     for(int i = 0; i < l->output_depth; i++) {
-        fscanf(fin, "%lf", &(l->biases->weights[i]));
+        l->biases->weights[i] = values[v++];
     }
 
-    fclose(fin);
+    free(values);
 }
 
 softmax_layer_t *make_softmax_layer(int input_width, int input_height, int input_depth) {
@@ -46,6 +46,11 @@ conv_layer_t *make_conv_layer(int input_width, int input_height, int input_depth
 // and stores the result into the relevant outputs.
 void conv_forward(conv_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end);
 
+// Computes only the output channels [f_start, f_end) of the output rows
+// [y_start, y_end) of a single image. Different parts of the same image can be
+// computed by different threads.
+void conv_forward_part(conv_layer_t *l, volume_t *in, volume_t *out, int f_start, int f_end, int y_start, int y_end);
+
 // Loads the convolutional layer weights from a file.
 void conv_load(conv_layer_t *l, const char *file_name);
 
@@ -69,6 +74,9 @@ relu_layer_t *make_relu_layer(int input_width, int input_height, int input_depth
 // stores the result into the relevant outputs.
 void relu_forward(relu_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end);
 
+// Computes only the rows [y_start, y_end) of a single image.
+void relu_forward_rows(relu_layer_t *l, volume_t *in, volume_t *out, int y_start, int y_end);
+
 // Pool Layer Parameters
 typedef struct pool_layer {
     // Required
@@ -94,6 +102,9 @@ pool_layer_t *make_pool_layer(int input_width, int input_height, int input_depth
 // stores the result into the relevant outputs.
 void pool_forward(pool_layer_t *l, volume_t **inputs, volume_t **outputs, int start, int end);
 
+// Computes only the output rows [y_start, y_end) of a single image.
+void pool_forward_rows(pool_layer_t *l, volume_t *in, volume_t *out, int y_start, int y_end);
+
 // FC Layer Parameters
 typedef struct fc_layer {
     // Required
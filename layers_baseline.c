@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include "layers.h"
+#include "memtrack.h"
 #include "volume.h"
 
 conv_layer_t *make_conv_layer(int input_width, int input_height, int input_depth, int filter_width, int num_filters,
@@ -27,12 +28,12 @@ conv_layer_t *make_conv_layer(int input_width, int input_height, int input_depth
 
     l->filters = malloc(sizeof(volume_t *) * num_filters);
     for (int i = 0; i < num_filters; i++) {
-        l->filters[i] = make_volume(l->filter_width, l->filter_height,
-            l->input_depth, 0.0);
+        l->filters[i] = make_volume_in(l->filter_width, l->filter_height,
+               l->input_depth, 0.0, MEM_WEIGHTS);
     }
 
     l->bias = 0.0;
-    l->biases = make_volume(1, 1, l->output_depth, l->bias);
+    l->biases = make_volume_in(1, 1, l->output_depth, l->bias, MEM_WEIGHTS);
 
     return l;
 }
@@ -249,11 +250,11 @@ fc_layer_t *make_fc_layer(int input_width, int input_height, int input_depth, in
 
     l->filters = (volume_t **) malloc(sizeof(volume_t *) * num_neurons);
     for (int i = 0; i < l->output_depth; i++) {
-        l->filters[i] = make_volume(1, 1, l->num_inputs, 0.0);
+        l->filters[i] = make_volume_in(1, 1, l->num_inputs, 0.0, MEM_WEIGHTS);
     }
 
     l->bias = 0.0;
-    l->biases = make_volume(1, 1, l->output_depth, l->bias);
+    l->biases = make_volume_in(1, 1, l->output_depth, l->bias, MEM_WEIGHTS);
 
     return l;
 }
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memtrack.h"
+#include "volume.h"
+
+// The counters of a category (and of the total), each on its own cache line,
+// so that threads working on different categories do not contend.
+typedef struct mem_counter {
+    long current;
+    long peak;
+} __attribute__((aligned(64))) mem_counter_t;
+
+static mem_counter_t counters[MEM_NUM_CATEGORIES];
+static mem_counter_t total;
+
+// Header in front of every block from mem_alloc, sized to keep the block
+// 16-byte aligned.
+typedef union mem_header {
+    struct {
+        size_t size;
+        int category;
+    } info;
+    char padding[16];
+} mem_header_t;
+
+static void raise_peak(long *p, long value) {
+    long seen = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(p, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void mem_add(int category, long bytes) {
+    if (category < 0) {
+        return;
+    }
+    mem_counter_t *c = &counters[category];
+    raise_peak(&c->peak, __atomic_add_fetch(&c->current, bytes, __ATOMIC_RELAXED));
+    raise_peak(&total.peak, __atomic_add_fetch(&total.current, bytes, __ATOMIC_RELAXED));
+}
+
+long mem_current(int category) {
+    return __atomic_load_n(&counters[category].current, __ATOMIC_RELAXED);
+}
+
+long mem_peak(int category) {
+    return __atomic_load_n(&counters[category].peak, __ATOMIC_RELAXED);
+}
+
+long mem_total_current(void) {
+    return __atomic_load_n(&total.current, __ATOMIC_RELAXED);
+}
+
+long mem_total_peak(void) {
+    return __atomic_load_n(&total.peak, __ATOMIC_RELAXED);
+}
+
+void *mem_alloc(size_t size, int category) {
+    mem_header_t *header = (mem_header_t *) malloc(sizeof(mem_header_t) + size);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->info.size = size;
+    header->info.category = category;
+    mem_add(category, (long) size);
+    return header + 1;
+}
+
+void mem_free(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    mem_header_t *header = (mem_header_t *) p - 1;
+    mem_add(header->info.category, -(long) header->info.size);
+    free(header);
+}
+
+size_t mem_volume_bytes(volume_t *v) {
+    return sizeof(volume_t) + sizeof(double) * v->width * v->height * v->depth;
+}
+
+long mem_rss(long *peak_rss) {
+    long rss = 0;
+    *peak_rss = 0;
+
+    FILE *fin = fopen("/proc/self/status", "r");
+    if (fin == NULL) {
+        return 0;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fin) != NULL) {
+        long kb;
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            rss = kb * 1024;
+        } else if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            *peak_rss = kb * 1024;
+        }
+    }
+    fclose(fin);
+    return rss;
+}
+
+void mem_report(void) {
+    static const char *names[MEM_NUM_CATEGORIES] = {"other", "weights", "activations", "dataset", "results"};
+    static const int order[MEM_NUM_CATEGORIES] = {MEM_WEIGHTS, MEM_ACTIVATIONS, MEM_DATASET, MEM_RESULTS, MEM_OTHER};
+
+    printf("%-12s %14s %14s\n", "MEMORY", "CURRENT(MB)", "PEAK(MB)");
+    for (int i = 0; i < MEM_NUM_CATEGORIES; i++) {
+        int c = order[i];
+        printf("%-12s %14.3f %14.3f\n", names[c], mem_current(c) / 1048576.0, mem_peak(c) / 1048576.0);
+    }
+    printf("%-12s %14.3f %14.3f\n", "total", mem_total_current() / 1048576.0, mem_total_peak() / 1048576.0);
+
+    long peak_rss;
+    long rss = mem_rss(&peak_rss);
+    printf("%-12s %14.3f %14.3f\n", "rss", rss / 1048576.0, peak_rss / 1048576.0);
+}
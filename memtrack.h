@@ -0,0 +1,54 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include <stddef.h>
+
+#include "volume.h"
+
+// Accounting of the memory that the network, its batches, the data set and
+// the results take up. Every volume (except views) counts towards one
+// category, and so does every array allocated with mem_alloc. For every
+// category, the bytes currently allocated and the most there ever were are
+// kept. They are updated with atomics, so volumes can be made and freed on any
+// thread.
+//
+// The category of a volume is given when it is made (see make_volume_in), so
+// every volume is counted exactly once. make_volume counts towards MEM_OTHER.
+
+#define MEM_UNTRACKED -1
+#define MEM_OTHER 0
+#define MEM_WEIGHTS 1       // Everything make_network allocates.
+#define MEM_ACTIVATIONS 2   // Batches.
+#define MEM_DATASET 3       // Images loaded from the data set.
+#define MEM_RESULTS 4       // Likelihoods and predictions.
+#define MEM_NUM_CATEGORIES 5
+
+// Adds bytes (which may be negative) to the current count of a category.
+void mem_add(int category, long bytes);
+
+// Returns the current and the peak number of bytes of a category.
+long mem_current(int category);
+long mem_peak(int category);
+
+// Returns the current and the peak number of bytes of all categories
+// together (the peak of the total can be lower than the sum of the peaks).
+long mem_total_current(void);
+long mem_total_peak(void);
+
+// Allocates size bytes that count towards category. The block has to be
+// freed with mem_free.
+void *mem_alloc(size_t size, int category);
+void mem_free(void *p);
+
+// Returns the bytes a volume takes up (its struct and its weights).
+size_t mem_volume_bytes(volume_t *v);
+
+// Returns the resident set size of the process in bytes, and stores its peak
+// in *peak (both 0 if /proc/self/status cannot be read).
+long mem_rss(long *peak);
+
+// Prints the current and peak bytes of every category, their total and the
+// resident set size.
+void mem_report(void);
+
+#endif
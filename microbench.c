@@ -0,0 +1,358 @@
+// Microbenchmarks for the building blocks of the network: every *_forward
+// kernel, make_batch, copy_volume and the loaders, each run in isolation on
+// random data (so, unlike benchmark, they do not need the cifar10 data set).
+//
+// Usage: ./microbench [name|all] [iterations] [warmup] [images] [WxHxD]
+//
+// Every benchmark first runs warmup untimed iterations, then the given number
+// of timed ones, and reports the minimum and the median time of an iteration.
+// An iteration processes the given number of images at once. The shape sets
+// the input volumes of the kernels (each kernel has its own default, the
+// shape of its first layer in the network). Benchmarks that only work on one
+// shape (make_batch, decode_sample and the loaders) ignore it. conv_forward
+// only handles input depths 3, 16 and 20, so conv refuses any other depth
+// (and all skips it) rather than timing a layer that only writes the biases.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Include OpenMP
+#include <omp.h>
+
+#include "cifar.h"
+#include "layers.h"
+#include "network.h"
+#include "volume.h"
+
+const int DEFAULT_ITERATIONS = 20;
+const int DEFAULT_WARMUP = 3;
+const int DEFAULT_IMAGES = 16;
+const int SEED = 1234;
+
+// Everything a benchmark works on. Whatever a benchmark does not need stays
+// NULL.
+typedef struct bench_state {
+    int images;
+    int width;
+    int height;
+    int depth;
+
+    volume_t **inputs;
+    volume_t **outputs;
+    uint8_t *records;
+    network_t *net;
+
+    conv_layer_t *conv;
+    relu_layer_t *relu;
+    pool_layer_t *pool;
+    fc_layer_t *fc;
+    softmax_layer_t *softmax;
+} bench_state_t;
+
+typedef struct microbench {
+    const char *name;
+
+    // Default input shape, and whether it can be changed.
+    int width;
+    int height;
+    int depth;
+    int fixed_shape;
+
+    void (*setup)(bench_state_t *s);
+    void (*run)(bench_state_t *s);
+} microbench_t;
+
+// Returns a random value in [-0.5, 0.5).
+double random_value() {
+    return (double) rand() / ((double) RAND_MAX + 1) - 0.5;
+}
+
+void fill_random(volume_t *v) {
+    int size = v->width * v->height * v->depth;
+    for (int i = 0; i < size; i++) {
+        v->weights[i] = random_value();
+    }
+}
+
+// Allocates images random volumes of the given shape.
+volume_t **make_random_volumes(int images, int width, int height, int depth) {
+    volume_t **volumes = (volume_t **) malloc(sizeof(volume_t *) * images);
+    for (int i = 0; i < images; i++) {
+        volumes[i] = make_volume(width, height, depth, 0.0);
+        fill_random(volumes[i]);
+    }
+    return volumes;
+}
+
+void free_volumes(volume_t **volumes, int images) {
+    if (volumes == NULL) {
+        return;
+    }
+    for (int i = 0; i < images; i++) {
+        free_volume(volumes[i]);
+    }
+    free(volumes);
+}
+
+void setup_inputs(bench_state_t *s) {
+    s->inputs = make_random_volumes(s->images, s->width, s->height, s->depth);
+}
+
+void setup_conv(bench_state_t *s) {
+    setup_inputs(s);
+    s->conv = make_conv_layer(s->width, s->height, s->depth, 5, 16, 1, 2);
+    for (int f = 0; f < s->conv->output_depth; f++) {
+        fill_random(s->conv->filters[f]);
+    }
+    fill_random(s->conv->biases);
+    s->outputs = make_random_volumes(s->images, s->conv->output_width, s->conv->output_height,
+                                     s->conv->output_depth);
+}
+
+// Whether conv_forward computes a layer with this input depth (it only has
+// kernels for the depths of the conv layers in the network).
+int conv_supports_depth(int depth) {
+    return depth == 3 || depth == 16 || depth == 20;
+}
+
+void run_conv(bench_state_t *s) {
+    conv_forward(s->conv, s->inputs, s->outputs, 0, s->images - 1);
+}
+
+void setup_relu(bench_state_t *s) {
+    setup_inputs(s);
+    s->relu = make_relu_layer(s->width, s->height, s->depth);
+    s->outputs = make_random_volumes(s->images, s->width, s->height, s->depth);
+}
+
+void run_relu(bench_state_t *s) {
+    relu_forward(s->relu, s->inputs, s->outputs, 0, s->images - 1);
+}
+
+void setup_pool(bench_state_t *s) {
+    setup_inputs(s);
+    s->pool = make_pool_layer(s->width, s->height, s->depth, 2, 2);
+    s->outputs = make_random_volumes(s->images, s->pool->output_width, s->pool->output_height,
+                                     s->pool->output_depth);
+}
+
+void run_pool(bench_state_t *s) {
+    pool_forward(s->pool, s->inputs, s->outputs, 0, s->images - 1);
+}
+
+void setup_fc(bench_state_t *s) {
+    setup_inputs(s);
+    s->fc = make_fc_layer(s->width, s->height, s->depth, NUM_CLASSES);
+    for (int f = 0; f < s->fc->output_depth; f++) {
+        fill_random(s->fc->filters[f]);
+    }
+    fill_random(s->fc->biases);
+    s->outputs = make_random_volumes(s->images, 1, 1, NUM_CLASSES);
+}
+
+void run_fc(bench_state_t *s) {
+    fc_forward(s->fc, s->inputs, s->outputs, 0, s->images - 1);
+}
+
+void setup_softmax(bench_state_t *s) {
+    setup_inputs(s);
+    s->softmax = make_softmax_layer(s->width, s->height, s->depth);
+    s->outputs = make_random_volumes(s->images, 1, 1, s->width * s->height * s->depth);
+}
+
+void run_softmax(bench_state_t *s) {
+    softmax_forward(s->softmax, s->inputs, s->outputs, 0, s->images - 1);
+}
+
+void setup_network(bench_state_t *s) {
+    s->net = make_network();
+}
+
+void run_make_batch(bench_state_t *s) {
+    free_batch(make_batch(s->net, s->images), s->images);
+}
+
+void setup_copy_volume(bench_state_t *s) {
+    setup_inputs(s);
+    s->outputs = make_random_volumes(s->images, s->width, s->height, s->depth);
+}
+
+void run_copy_volume(bench_state_t *s) {
+    for (int i = 0; i < s->images; i++) {
+        copy_volume(s->outputs[i], s->inputs[i]);
+    }
+}
+
+void setup_decode_sample(bench_state_t *s) {
+    s->records = (uint8_t *) malloc(3073 * s->images);
+    for (int i = 0; i < 3073 * s->images; i++) {
+        s->records[i] = (uint8_t) (rand() & 0xff);
+    }
+    s->outputs = make_random_volumes(s->images, 32, 32, 3);
+}
+
+void run_decode_sample(bench_state_t *s) {
+    for (int i = 0; i < s->images; i++) {
+        decode_sample(s->outputs[i], s->records + i * 3073);
+    }
+}
+
+// The loaders read the weights of the real network, so they ignore the shape
+// and load each file once per iteration.
+void run_conv_load(bench_state_t *s) {
+    conv_load(s->net->l0, "./snapshot/layer1_conv.txt");
+}
+
+void run_fc_load(bench_state_t *s) {
+    fc_load(s->net->l9, "./snapshot/layer10_fc.txt");
+}
+
+const microbench_t benchmarks[] = {
+    {"conv", 32, 32, 3, 0, setup_conv, run_conv},
+    {"relu", 32, 32, 16, 0, setup_relu, run_relu},
+    {"pool", 32, 32, 16, 0, setup_pool, run_pool},
+    {"fc", 4, 4, 20, 0, setup_fc, run_fc},
+    {"softmax", 1, 1, 10, 0, setup_softmax, run_softmax},
+    {"make_batch", 32, 32, 3, 1, setup_network, run_make_batch},
+    {"copy_volume", 32, 32, 3, 0, setup_copy_volume, run_copy_volume},
+    {"decode_sample", 32, 32, 3, 1, setup_decode_sample, run_decode_sample},
+    {"conv_load", 32, 32, 3, 1, setup_network, run_conv_load},
+    {"fc_load", 32, 32, 3, 1, setup_network, run_fc_load},
+};
+const int NUM_BENCHMARKS = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+void free_bench_state(bench_state_t *s) {
+    free_volumes(s->inputs, s->images);
+    free_volumes(s->outputs, s->images);
+    free(s->records);
+    if (s->net != NULL) {
+        free_network(s->net);
+    }
+
+    conv_layer_t *conv = s->conv;
+    if (conv != NULL) {
+        for (int f = 0; f < conv->output_depth; f++) {
+            free_volume(conv->filters[f]);
+        }
+        free(conv->filters);
+        free_volume(conv->biases);
+        free(conv);
+    }
+    if (s->fc != NULL) {
+        for (int f = 0; f < s->fc->output_depth; f++) {
+            free_volume(s->fc->filters[f]);
+        }
+        free(s->fc->filters);
+        free_volume(s->fc->biases);
+        free(s->fc);
+    }
+    if (s->softmax != NULL) {
+        free(s->softmax->likelihoods);
+        free(s->softmax);
+    }
+    free(s->relu);
+    free(s->pool);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+void run_benchmark(const microbench_t *b, int iterations, int warmup, int images, int width, int height, int depth) {
+    bench_state_t s;
+    memset(&s, 0, sizeof(s));
+    s.images = images;
+    s.width = width > 0 && !b->fixed_shape ? width : b->width;
+    s.height = height > 0 && !b->fixed_shape ? height : b->height;
+    s.depth = depth > 0 && !b->fixed_shape ? depth : b->depth;
+
+    srand(SEED);
+    b->setup(&s);
+
+    for (int i = 0; i < warmup; i++) {
+        b->run(&s);
+    }
+
+    double *times = (double *) malloc(sizeof(double) * iterations);
+    for (int i = 0; i < iterations; i++) {
+        double start = omp_get_wtime();
+        b->run(&s);
+        times[i] = (omp_get_wtime() - start) * 1e6;
+    }
+    qsort(times, iterations, sizeof(double), compare_double);
+
+    char shape[64];
+    sprintf(shape, "%dx%dx%d", s.width, s.height, s.depth);
+    printf("%-14s %-12s %7d %12.2f %12.2f %14.3f\n", b->name, shape, images, times[0], times[iterations / 2],
+           times[iterations / 2] / images);
+
+    free(times);
+    free_bench_state(&s);
+}
+
+int main(int argc, char **argv) {
+    const char *name = "all";
+    int iterations = DEFAULT_ITERATIONS;
+    int warmup = DEFAULT_WARMUP;
+    int images = DEFAULT_IMAGES;
+    int width = 0, height = 0, depth = 0;
+
+    if (argc > 1)
+        name = argv[1];
+    if (argc > 2)
+        iterations = atoi(argv[2]);
+    if (argc > 3)
+        warmup = atoi(argv[3]);
+    if (argc > 4)
+        images = atoi(argv[4]);
+    if (argc > 5 && sscanf(argv[5], "%dx%dx%d", &width, &height, &depth) != 3) {
+        printf("ERROR: The shape has to be given as WxHxD\n");
+        return 2;
+    }
+
+    assert(iterations > 0 && warmup >= 0 && images > 0);
+
+    int skip_conv = depth > 0 && !conv_supports_depth(depth);
+    if (skip_conv && !strcmp(name, "conv")) {
+        printf("ERROR: conv only supports input depths 3, 16 and 20\n");
+        return 2;
+    }
+
+    printf("%-14s %-12s %7s %12s %12s %14s\n", "KERNEL", "SHAPE", "IMAGES", "MIN(us)", "MEDIAN(us)",
+           "MEDIAN/IMAGE");
+
+    int found = 0, ignored = 0;
+    for (int i = 0; i < NUM_BENCHMARKS; i++) {
+        if (!strcmp(name, "all") || !strcmp(name, benchmarks[i].name)) {
+            found = 1;
+            if (skip_conv && benchmarks[i].setup == setup_conv) {
+                continue;
+            }
+            run_benchmark(&benchmarks[i], iterations, warmup, images, width, height, depth);
+            ignored |= width > 0 && benchmarks[i].fixed_shape;
+        }
+    }
+
+    if (ignored) {
+        printf("Note: make_batch, decode_sample, conv_load and fc_load ignore the shape\n");
+    }
+
+    if (skip_conv && found) {
+        printf("Note: conv skipped, it only supports input depths 3, 16 and 20\n");
+    }
+
+    if (!found) {
+        printf("ERROR: Unknown kernel (one of");
+        for (int i = 0; i < NUM_BENCHMARKS; i++) {
+            printf(" %s", benchmarks[i].name);
+        }
+        printf(" or all)\n");
+        return 2;
+    }
+
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <assert.h>
+#include <math.h>
 #include <stdlib.h>
 
 // Include SSE intrinsics
@@ -11,47 +13,67 @@
 // Include OpenMP
 #include <omp.h>
 
+#include "instrument.h"
+#include "latency.h"
 #include "layers.h"
+#include "memtrack.h"
 #include "network.h"
 #include "volume.h"
 
+// Number of output channels of a convolution that a thread computes together in
+// net_forward_parallel (for one output row).
+#define CONV_CHANNEL_BLOCK 4
+
+// Number of images a thread claims at a time in the classification loops.
+static int chunk_size = DEFAULT_CHUNK_SIZE;
+
+// Consulted by net_classify and net_classify_output (if not NULL).
+static result_cache_t *result_cache = NULL;
+
+// Cost model of net_classify_adaptive: image_seconds[g] is the time one image
+// takes with g threads, for every g that divides calibrated_threads (and 0 for
+// all other g).
+static int calibrated_threads = 0;
+static double *image_seconds = NULL;
+
 network_t *make_network() {
     network_t *net = (network_t *) malloc(sizeof(network_t));
 
-    net->layers[0] = make_volume(32, 32, 3, 0.0);
+    net->layers[0] = make_volume_in(32, 32, 3, 0.0, MEM_WEIGHTS);
     net->l0 = make_conv_layer(32, 32, 3, 5, 16, 1, 2);
 
-    net->layers[1] = make_volume(net->l0->output_width, net->l0->output_height, net->l0->output_depth, 0.0);
+    net->layers[1] = make_volume_in(net->l0->output_width, net->l0->output_height, net->l0->output_depth, 0.0, MEM_WEIGHTS);
     net->l1 = make_relu_layer(net->layers[1]->width, net->layers[1]->height, net->layers[1]->depth);
 
-    net->layers[2] = make_volume(net->l1->output_width, net->l1->output_height, net->l1->output_depth, 0.0);
+    net->layers[2] = make_volume_in(net->l1->output_width, net->l1->output_height, net->l1->output_depth, 0.0, MEM_WEIGHTS);
     net->l2 = make_pool_layer(net->layers[2]->width, net->layers[2]->height, net->layers[2]->depth, 2, 2);
 
-    net->layers[3] = make_volume(net->l2->output_width, net->l2->output_height, net->l2->output_depth, 0.0);
+    net->layers[3] = make_volume_in(net->l2->output_width, net->l2->output_height, net->l2->output_depth, 0.0, MEM_WEIGHTS);
     net->l3 = make_conv_layer(net->layers[3]->width, net->layers[3]->height, net->layers[3]->depth, 5, 20, 1, 2);
 
-    net->layers[4] = make_volume(net->l3->output_width, net->l3->output_height, net->l3->output_depth, 0.0);
+    net->layers[4] = make_volume_in(net->l3->output_width, net->l3->output_height, net->l3->output_depth, 0.0, MEM_WEIGHTS);
     net->l4 = make_relu_layer(net->layers[4]->width, net->layers[4]->height, net->layers[4]->depth);
 
-    net->layers[5] = make_volume(net->l4->output_width, net->l4->output_height, net->l4->output_depth, 0.0);
+    net->layers[5] = make_volume_in(net->l4->output_width, net->l4->output_height, net->l4->output_depth, 0.0, MEM_WEIGHTS);
     net->l5 = make_pool_layer(net->layers[5]->width, net->layers[5]->height, net->layers[5]->depth, 2, 2);
 
-    net->layers[6] = make_volume(net->l5->output_width, net->l5->output_height, net->l5->output_depth, 0.0);
+    net->layers[6] = make_volume_in(net->l5->output_width, net->l5->output_height, net->l5->output_depth, 0.0, MEM_WEIGHTS);
     net->l6 = make_conv_layer(net->layers[6]->width, net->layers[6]->height, net->layers[6]->depth, 5, 20, 1, 2);
 
-    net->layers[7] = make_volume(net->l6->output_width, net->l6->output_height, net->l6->output_depth, 0.0);
+    net->layers[7] = make_volume_in(net->l6->output_width, net->l6->output_height, net->l6->output_depth, 0.0, MEM_WEIGHTS);
     net->l7 = make_relu_layer(net->layers[7]->width, net->layers[7]->height, net->layers[7]->depth);
 
-    net->layers[8] = make_volume(net->l7->output_width, net->l7->output_height, net->l7->output_depth, 0.0);
+    net->layers[8] = make_volume_in(net->l7->output_width, net->l7->output_height, net->l7->output_depth, 0.0, MEM_WEIGHTS);
     net->l8 = make_pool_layer(net->layers[8]->width, net->layers[8]->height, net->layers[8]->depth, 2, 2);
 
-    net->layers[9] = make_volume(net->l8->output_width, net->l8->output_height, net->l8->output_depth, 0.0);
+    net->layers[9] = make_volume_in(net->l8->output_width, net->l8->output_height, net->l8->output_depth, 0.0, MEM_WEIGHTS);
     net->l9 = make_fc_layer(net->layers[9]->width, net->layers[9]->height, net->layers[9]->depth, 10);
 
-    net->layers[10] = make_volume(net->l9->output_width, net->l9->output_height, net->l9->output_depth, 0.0);
+    net->layers[10] = make_volume_in(net->l9->output_width, net->l9->output_height, net->l9->output_depth, 0.0, MEM_WEIGHTS);
     net->l10 = make_softmax_layer(net->layers[10]->width, net->layers[10]->height, net->layers[10]->depth);
 
-    net->layers[11] = make_volume(net->l10->output_width, net->l10->output_height, net->l10->output_depth, 0.0);
+    net->layers[11] = make_volume_in(net->l10->output_width, net->l10->output_height, net->l10->output_depth, 0.0, MEM_WEIGHTS);
+
     return net;
 }
 
@@ -112,13 +134,13 @@ batch_t *make_batch(network_t *net, int size) {
 //        }
         // Unrolling
         for(int j = 0; j < size/4*4; j += 4){
-            out[i][j] = make_volume(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0);
-            out[i][j+1] = make_volume(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0);
-            out[i][j+2] = make_volume(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0);
-            out[i][j+3] = make_volume(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0);
+            out[i][j] = make_volume_in(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0, MEM_ACTIVATIONS);
+            out[i][j+1] = make_volume_in(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0, MEM_ACTIVATIONS);
+            out[i][j+2] = make_volume_in(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0, MEM_ACTIVATIONS);
+            out[i][j+3] = make_volume_in(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0, MEM_ACTIVATIONS);
         }
         for(int j = size/4*4; j < size; j++){
-            out[i][j] = make_volume(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0);
+            out[i][j] = make_volume_in(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0, MEM_ACTIVATIONS);
         }
     }
     return out;
@@ -134,7 +156,43 @@ void free_batch(batch_t *b, int size) {
     free(b);
 }
 
+void net_set_chunk_size(int size) {
+    assert(size > 0);
+    chunk_size = size;
+}
+
+void net_set_result_cache(result_cache_t *cache) {
+    assert(cache == NULL || cache->num_values == NUM_CLASSES);
+    result_cache = cache;
+}
+
+// Classifies one input with the single-image batch b and returns its
+// likelihoods. If there is a result cache, the result is taken from it when
+// possible (copied to cached) and added to it otherwise.
+static double *classify_cached(network_t *net, batch_t *b, volume_t *input, double *cached) {
+    result_cache_key_t key;
+    if (result_cache != NULL) {
+        key = result_cache_fingerprint(input);
+        if (result_cache_lookup(result_cache, key, cached)) {
+            return cached;
+        }
+    }
+
+    bind_input(b, 0, input);
+    net_forward(net, b, 0, 0);
+
+    if (result_cache != NULL) {
+        result_cache_insert(result_cache, key, b[11][0]->weights);
+    }
+    return b[11][0]->weights;
+}
+
 void net_forward(network_t *net, batch_t *b, int start, int end) {
+    if (instrument_flags) {
+        instrument_forward(net, b, start, end);
+        return;
+    }
+
     conv_forward(net->l0, b[0], b[1], start, end);
     relu_forward(net->l1, b[1], b[2], start, end);
     pool_forward(net->l2, b[2], b[3], start, end);
@@ -148,6 +206,164 @@ void net_forward(network_t *net, batch_t *b, int start, int end) {
     softmax_forward(net->l10, b[10], b[11], start, end);
 }
 
+// The per-layer steps of net_forward_parallel. They are called by every thread
+// of the team, split the layer with an (orphaned) worksharing loop and end with
+// its implicit barrier, so the next layer only starts once this one is done.
+static void conv_forward_team(conv_layer_t *l, volume_t *in, volume_t *out) {
+    int blocks = (l->output_depth + CONV_CHANNEL_BLOCK - 1) / CONV_CHANNEL_BLOCK;
+#pragma omp for schedule(static) collapse(2)
+    for (int block = 0; block < blocks; block++) {
+        for (int y = 0; y < l->output_height; y++) {
+            int f_start = block * CONV_CHANNEL_BLOCK;
+            int f_end = f_start + CONV_CHANNEL_BLOCK < l->output_depth ? f_start + CONV_CHANNEL_BLOCK : l->output_depth;
+            conv_forward_part(l, in, out, f_start, f_end, y, y + 1);
+        }
+    }
+}
+
+static void relu_forward_team(relu_layer_t *l, volume_t *in, volume_t *out) {
+#pragma omp for schedule(static)
+    for (int y = 0; y < l->input_height; y++) {
+        relu_forward_rows(l, in, out, y, y + 1);
+    }
+}
+
+static void pool_forward_team(pool_layer_t *l, volume_t *in, volume_t *out) {
+#pragma omp for schedule(static)
+    for (int y = 0; y < l->output_height; y++) {
+        pool_forward_rows(l, in, out, y, y + 1);
+    }
+}
+
+void net_forward_parallel(network_t *net, batch_t *b, int j, int num_threads) {
+    uint64_t begin = instrument_flags ? instrument_now() : 0;
+
+#pragma omp parallel num_threads(num_threads)
+    {
+        conv_forward_team(net->l0, b[0][j], b[1][j]);
+        relu_forward_team(net->l1, b[1][j], b[2][j]);
+        pool_forward_team(net->l2, b[2][j], b[3][j]);
+        conv_forward_team(net->l3, b[3][j], b[4][j]);
+        relu_forward_team(net->l4, b[4][j], b[5][j]);
+        pool_forward_team(net->l5, b[5][j], b[6][j]);
+        conv_forward_team(net->l6, b[6][j], b[7][j]);
+        relu_forward_team(net->l7, b[7][j], b[8][j]);
+        pool_forward_team(net->l8, b[8][j], b[9][j]);
+
+        // The last two layers are far too small to be worth splitting.
+#pragma omp single
+        {
+            fc_forward(net->l9, b[9], b[10], j, j);
+            softmax_forward(net->l10, b[10], b[11], j, j);
+        }
+    }
+
+    if (instrument_flags) {
+        instrument_pass(begin, LATENCY_PARALLEL, 1);
+    }
+}
+
+void net_classify_latency(network_t *net, batch_t *b, volume_t *input, double *likelihoods) {
+    bind_input(b, 0, input);
+
+    net_forward_parallel(net, b, 0, omp_get_max_threads());
+    for (int j = 0; j < NUM_CLASSES; j++) {
+        likelihoods[j] = b[11][0]->weights[j];
+    }
+}
+
+void net_calibrate(network_t *net) {
+    int threads = omp_get_max_threads();
+    free(image_seconds);
+    image_seconds = (double *) calloc(threads + 1, sizeof(double));
+
+    batch_t *b = make_batch(net, 1);
+    for (int g = 1; g <= threads; g++) {
+        if (threads % g != 0) {
+            continue;
+        }
+
+        // Warm up once, then keep the fastest of a few runs.
+        net_forward_parallel(net, b, 0, g);
+        double best = INFINITY;
+        for (int r = 0; r < 3; r++) {
+            double start = omp_get_wtime();
+            net_forward_parallel(net, b, 0, g);
+            double elapsed = omp_get_wtime() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        image_seconds[g] = best;
+    }
+    free_batch(b, 1);
+
+    calibrated_threads = threads;
+}
+
+int net_threads_per_image(int n) {
+    int threads = omp_get_max_threads();
+
+    // Without a model, only spread images over threads when there are too few
+    // of them to keep every thread busy: use the largest groups that still give
+    // every image a group of its own.
+    if (calibrated_threads != threads) {
+        for (int g = threads; g > 1; g--) {
+            if (threads % g == 0 && threads / g >= n) {
+                return g;
+            }
+        }
+        return 1;
+    }
+
+    int best_g = 1;
+    double best_cost = INFINITY;
+    for (int g = 1; g <= threads; g++) {
+        if (threads % g != 0) {
+            continue;
+        }
+
+        // Images are processed in rounds of one image per group.
+        int groups = threads / g;
+        double cost = ((n + groups - 1) / groups) * image_seconds[g];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_g = g;
+        }
+    }
+    return best_g;
+}
+
+void net_classify_adaptive(network_t *net, volume_t **input, net_output_t *out, int n) {
+    if (n <= 0) {
+        return;
+    }
+
+    int group_size = net_threads_per_image(n);
+    if (group_size == 1) {
+        net_classify_output(net, input, out, n);
+        return;
+    }
+
+    // Every thread of the outer team works on one image at a time with a
+    // nested team of group_size threads.
+    int groups = omp_get_max_threads() / group_size;
+    int levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+
+#pragma omp parallel num_threads(groups)
+    {
+        batch_t *b = make_batch_view(net, 1);
+#pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < n; i++) {
+            bind_input(b, 0, input[i]);
+            net_forward_parallel(net, b, 0, group_size);
+            net_store_output(out, i, b[11][0]->weights);
+        }
+        free_batch_view(b, 1);
+    }
+
+    omp_set_max_active_levels(levels);
+}
+
 void net_classify(network_t *net, volume_t **input, double **likelihoods, int n) {
 
 
@@ -162,91 +378,99 @@ void net_classify(network_t *net, volume_t **input, double **likelihoods, int n)
 //    }
 //    free_batch(b, 1);
 
-//#pragma omp parallel
-//    {
-//        batch_t *b = make_batch(net, 1);
-//        for (int i = 0; i < n; i++) {
-//            copy_volume(b[0][0], input[i]);
-//            net_forward(net, b, 0, 0);
-//        #pragma omp for
-//            for (int j = 0; j < NUM_CLASSES; j++) {
-//                likelihoods[i][j] = b[11][0]->weights[j];
-//            }
-//        }
-//    free_batch(b, 1);
-//    }
+    // Threads claim chunk_size images at a time, so a thread that falls behind
+    // (or gets preempted) simply claims fewer chunks. Every image is computed
+    // by a single thread with the same code, so the results do not depend on
+    // the schedule.
 #pragma omp parallel
     {
-        batch_t *b = make_batch(net, 1);
-#pragma omp for
-        for (int i = 0; i < n/4*4; i+=4) {
-            copy_volume(b[0][0], input[i]);
-            net_forward(net, b, 0, 0);
-            for (int j = 0; j < NUM_CLASSES/4*4; j+=4) {
-                likelihoods[i][j] = b[11][0]->weights[j];
-                likelihoods[i][j+1] = b[11][0]->weights[j+1];
-                likelihoods[i][j+2] = b[11][0]->weights[j+2];
-                likelihoods[i][j+3] = b[11][0]->weights[j+3];
-            }
-            for(int j = NUM_CLASSES/4*4; j < NUM_CLASSES; j++){
-                likelihoods[i][j] = b[11][0]->weights[j];
+        batch_t *b = make_batch_view(net, 1);
+        double cached[NUM_CLASSES];
+#pragma omp for schedule(dynamic, chunk_size)
+        for (int i = 0; i < n; i++) {
+            double *result = classify_cached(net, b, input[i], cached);
+            for (int j = 0; j < NUM_CLASSES; j++) {
+                likelihoods[i][j] = result[j];
             }
+        }
+        free_batch_view(b, 1);
+    }
+}
 
+void net_classify_output(network_t *net, volume_t **input, net_output_t *out, int n) {
+    assert(out->mode != NET_OUTPUT_TOP_K || (out->k > 0 && out->k <= NUM_CLASSES));
 
-            copy_volume(b[0][0], input[i+1]);
-            net_forward(net, b, 0, 0);
-            for (int j = 0; j < NUM_CLASSES/4*4; j+=4) {
-                likelihoods[i+1][j] = b[11][0]->weights[j];
-                likelihoods[i+1][j+1] = b[11][0]->weights[j+1];
-                likelihoods[i+1][j+2] = b[11][0]->weights[j+2];
-                likelihoods[i+1][j+3] = b[11][0]->weights[j+3];
-            }
-            for(int j = NUM_CLASSES/4*4; j < NUM_CLASSES; j++){
-                likelihoods[i+1][j] = b[11][0]->weights[j];
-            }
+#pragma omp parallel
+    {
+        batch_t *b = make_batch_view(net, 1);
+        double cached[NUM_CLASSES];
+#pragma omp for schedule(dynamic, chunk_size)
+        for (int i = 0; i < n; i++) {
+            net_store_output(out, i, classify_cached(net, b, input[i], cached));
+        }
+        free_batch_view(b, 1);
+    }
+}
 
+long net_classify_stream(network_t *net, net_source_t source, void *source_ctx, net_sink_t sink, void *sink_ctx,
+        int window) {
+    assert(window > 0);
+    volume_t **inputs = (volume_t **) malloc(sizeof(volume_t *) * window);
+    for (int w = 0; w < window; w++) {
+        inputs[w] = make_volume_in(net->layers[0]->width, net->layers[0]->height, net->layers[0]->depth, 0.0,
+                                   MEM_DATASET);
+    }
+    double *results = (double *) malloc(sizeof(double) * NUM_CLASSES * window);
 
-            copy_volume(b[0][0], input[i+2]);
-            net_forward(net, b, 0, 0);
-            for (int j = 0; j < NUM_CLASSES/4*4; j+=4) {
-                likelihoods[i+2][j] = b[11][0]->weights[j];
-                likelihoods[i+2][j+1] = b[11][0]->weights[j+1];
-                likelihoods[i+2][j+2] = b[11][0]->weights[j+2];
-                likelihoods[i+2][j+3] = b[11][0]->weights[j+3];
-            }
-            for(int j = NUM_CLASSES/4*4; j < NUM_CLASSES; j++){
-                likelihoods[i+2][j] = b[11][0]->weights[j];
+    long done = 0;
+    int filled = 0;
+    int finished = 0;
+
+#pragma omp parallel
+    {
+        // Every thread keeps its batch for the whole stream.
+        batch_t *b = make_batch_view(net, 1);
+
+        while (1) {
+#pragma omp single
+            {
+                filled = 0;
+                while (filled < window && source(source_ctx, inputs[filled])) {
+                    filled++;
+                }
             }
 
+#pragma omp for schedule(dynamic, chunk_size)
+            for (int w = 0; w < filled; w++) {
+                bind_input(b, 0, inputs[w]);
+                net_forward(net, b, 0, 0);
+                for (int j = 0; j < NUM_CLASSES; j++) {
+                    results[w * NUM_CLASSES + j] = b[11][0]->weights[j];
+                }
+            }
 
-            copy_volume(b[0][0], input[i+3]);
-            net_forward(net, b, 0, 0);
-            for (int j = 0; j < NUM_CLASSES/4*4; j+=4) {
-                likelihoods[i+3][j] = b[11][0]->weights[j];
-                likelihoods[i+3][j+1] = b[11][0]->weights[j+1];
-                likelihoods[i+3][j+2] = b[11][0]->weights[j+2];
-                likelihoods[i+3][j+3] = b[11][0]->weights[j+3];
+#pragma omp single
+            {
+                for (int w = 0; w < filled; w++) {
+                    sink(sink_ctx, done + w, results + w * NUM_CLASSES);
+                }
+                done += filled;
+                finished = (filled < window);
             }
-            for(int j = NUM_CLASSES/4*4; j < NUM_CLASSES; j++){
-                likelihoods[i+3][j] = b[11][0]->weights[j];
+
+            if (finished) {
+                break;
             }
         }
-        free_batch(b, 1);
+
+        free_batch_view(b, 1);
     }
 
+    for (int w = 0; w < window; w++) {
+        free_volume(inputs[w]);
+    }
+    free(inputs);
+    free(results);
 
-//#pragma omp parallel
-//    {
-//        int num = omp_get_num_threads();
-//        batch_t *b = make_batch(net, num);
-//        int chunk_size = n/omp_get_num_threads();
-//        for (int i = n * chunk_size; i<((n + 1) * chunk_size); i++) {
-//            copy_volume(b[0][0], input[i]);
-//            net_forward(net, b, 0, 0);
-//            for (int j = 0; j < NUM_CLASSES; j++) {
-//                likelihoods[i][j] = b[11][0]->weights[j];
-//            }
-//        }
-//        free_batch(b, num);
-//    }
+    return done;
 }
\ No newline at end of file
@@ -1,12 +1,16 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include "cache.h"
 #include "layers.h"
 #include "volume.h"
 
 #define NUM_LAYERS 11
 #define NUM_CLASSES 10
 
+// Default number of images a thread claims at a time in net_classify.
+#define DEFAULT_CHUNK_SIZE 4
+
 // Defines the specific network architecture that we use for this project. Layer
 // elements in the struct are in the same order as they are in the network
 // itself.
@@ -31,6 +35,10 @@ network_t* make_network();
 // Frees our network
 void free_network(network_t* net);
 
+// Creates a new instance of our network with a copy of the weights of net. The
+// memory is first touched by the calling thread, so it ends up on its node.
+network_t* copy_network(network_t* net);
+
 // We organize data as "batches" of volumes. Each batch consists of a number of
 // samples, each of which contains a volume for every intermediate layer. Say we
 // have L layers and a set of N input images. Then batch[l][n] contains the
@@ -46,14 +54,117 @@ batch_t* make_batch(network_t* net, int size);
 // Frees a previously allocated batch
 void free_batch(batch_t* v, int size);
 
+// Like make_batch, but the input volumes (layer 0) of the batch are views that
+// own no memory. Before running net_forward on image j, point it at an input
+// with bind_input. The first layer then reads the input in place.
+batch_t* make_batch_view(network_t* net, int size);
+
+// Frees a batch allocated with make_batch_view (but not the bound inputs).
+void free_batch_view(batch_t* b, int size);
+
+// Binds image j of a batch created by make_batch_view to input, without
+// copying it. The input has to have the dimensions of the network's input.
+void bind_input(batch_t* b, int j, volume_t* input);
+
+// Sets how many consecutive images a thread claims at a time when net_classify
+// hands out work (DEFAULT_CHUNK_SIZE unless changed). Smaller chunks balance
+// the load better, larger chunks have less scheduling overhead.
+void net_set_chunk_size(int size);
+
+// Puts a result cache (with NUM_CLASSES values per input) in front of
+// net_classify and net_classify_output: images that are already in the cache
+// are not classified again. Pass NULL to turn the cache off again (the
+// default). The cache has to outlive its use.
+void net_set_result_cache(result_cache_t *cache);
+
 // Apply our network to a specific batch of inputs. The batch has to be given
 // as input to v and start/end are the first and the last image in that batch
 // to process (start and end are inclusive).
 void net_forward(network_t* net, batch_t* b, int start, int end);
 
+// Like net_forward, but only applies layers first to last - 1 (so it reads
+// b[first] and writes b[first + 1] to b[last]).
+void net_forward_layers(network_t* net, batch_t* b, int first, int last, int start, int end);
+
+// Applies the network to image j of a batch with num_threads threads that all
+// work on that one image: convolutions are split into blocks of output
+// channels and output rows, ReLU and pooling layers into rows, with a barrier
+// between consecutive layers. This lowers the latency of a single image at the
+// cost of some throughput.
+void net_forward_parallel(network_t* net, batch_t* b, int j, int num_threads);
+
 // Putting everything together: Take a set of n input images as 3-dimensional
 // Volumes and process them using the CNN in batches of 1. It saves the
 // likelihood of each label into the likelihoods array.
 void net_classify(network_t *net, volume_t **input, double **likelihoods, int n);
 
+// Output formats for net_classify_output. Results are written to contiguous
+// row-major buffers with one row per image instead of n separate arrays.
+typedef enum net_output_mode {
+    NET_OUTPUT_DOUBLE,  // n x NUM_CLASSES likelihoods as doubles
+    NET_OUTPUT_FLOAT,   // n x NUM_CLASSES likelihoods as floats
+    NET_OUTPUT_TOP_K    // n x k most likely classes (best first) and their likelihoods
+} net_output_mode_t;
+
+typedef struct net_output {
+    net_output_mode_t mode;
+
+    // Used by NET_OUTPUT_DOUBLE and NET_OUTPUT_FLOAT respectively.
+    double *likelihoods;
+    float *likelihoods_f;
+
+    // Used by NET_OUTPUT_TOP_K. Ties are broken in favor of the lower class.
+    int k;
+    int *classes;
+    double *scores;
+} net_output_t;
+
+// Classifies a single image as fast as possible by spreading its work across
+// all threads (see net_forward_parallel), for interactive requests. b is a
+// single-image batch from make_batch_view that the caller keeps across
+// requests, so a request does not pay for allocating activations.
+void net_classify_latency(network_t *net, batch_t *b, volume_t *input, double *likelihoods);
+
+// Calibrates the cost model of net_classify_adaptive: measures how long one
+// image takes with every number of threads per image that evenly divides the
+// number of OpenMP threads. Call it once at startup, after loading weights.
+void net_calibrate(network_t *net);
+
+// Number of threads that net_classify_adaptive puts on every image when n
+// images are pending.
+int net_threads_per_image(int n);
+
+// Like net_classify_output, but chooses between one thread per image, all
+// threads on one image, and mixes in between (such as 4 threads per image for
+// N/4 images at a time) depending on the number of pending images. With a
+// calibrated cost model, it picks the split with the shortest estimated time;
+// otherwise it only spreads images over threads when there are too few images
+// to keep every thread busy.
+void net_classify_adaptive(network_t *net, volume_t **input, net_output_t *out, int n);
+
+// Same as net_classify, but writes the results in the format described by out.
+void net_classify_output(network_t *net, volume_t **input, net_output_t *out, int n);
+
+// Writes the likelihoods of image i into the buffers of out.
+void net_store_output(net_output_t *out, int i, double *likelihoods);
+
+// Streaming classification: instead of taking all n inputs at once, images are
+// pulled from a source one at a time and their likelihoods are handed to a
+// sink in input order. Only a fixed window of images is in flight at any time,
+// so memory use does not depend on the length of the stream.
+//
+// The source fills the given volume (with the dimensions of the network's
+// input layer) with the next image and returns 1, or returns 0 once the stream
+// is exhausted. The sink receives the position of the image in the stream and
+// its NUM_CLASSES likelihoods. Both are only ever called from one thread at a
+// time.
+typedef int (*net_source_t)(void *ctx, volume_t *input);
+typedef void (*net_sink_t)(void *ctx, long index, double *likelihoods);
+
+// Classifies every image produced by source, keeping at most window images in
+// flight, and returns the number of images classified. window has to be
+// positive.
+long net_classify_stream(network_t *net, net_source_t source, void *source_ctx, net_sink_t sink, void *sink_ctx,
+        int window);
+
 #endif
\ No newline at end of file
@@ -1,46 +1,50 @@
+#include <assert.h>
 #include <stdlib.h>
 
+#include "instrument.h"
 #include "layers.h"
+#include "memtrack.h"
 #include "network.h"
 #include "volume.h"
 
 network_t *make_network() {
     network_t *net = (network_t *) malloc(sizeof(network_t));
 
-    net->layers[0] = make_volume(32, 32, 3, 0.0);
+    net->layers[0] = make_volume_in(32, 32, 3, 0.0, MEM_WEIGHTS);
     net->l0 = make_conv_layer(32, 32, 3, 5, 16, 1, 2);
 
-    net->layers[1] = make_volume(net->l0->output_width, net->l0->output_height, net->l0->output_depth, 0.0);
+    net->layers[1] = make_volume_in(net->l0->output_width, net->l0->output_height, net->l0->output_depth, 0.0, MEM_WEIGHTS);
     net->l1 = make_relu_layer(net->layers[1]->width, net->layers[1]->height, net->layers[1]->depth);
 
-    net->layers[2] = make_volume(net->l1->output_width, net->l1->output_height, net->l1->output_depth, 0.0);
+    net->layers[2] = make_volume_in(net->l1->output_width, net->l1->output_height, net->l1->output_depth, 0.0, MEM_WEIGHTS);
     net->l2 = make_pool_layer(net->layers[2]->width, net->layers[2]->height, net->layers[2]->depth, 2, 2);
 
-    net->layers[3] = make_volume(net->l2->output_width, net->l2->output_height, net->l2->output_depth, 0.0);
+    net->layers[3] = make_volume_in(net->l2->output_width, net->l2->output_height, net->l2->output_depth, 0.0, MEM_WEIGHTS);
     net->l3 = make_conv_layer(net->layers[3]->width, net->layers[3]->height, net->layers[3]->depth, 5, 20, 1, 2);
 
-    net->layers[4] = make_volume(net->l3->output_width, net->l3->output_height, net->l3->output_depth, 0.0);
+    net->layers[4] = make_volume_in(net->l3->output_width, net->l3->output_height, net->l3->output_depth, 0.0, MEM_WEIGHTS);
     net->l4 = make_relu_layer(net->layers[4]->width, net->layers[4]->height, net->layers[4]->depth);
 
-    net->layers[5] = make_volume(net->l4->output_width, net->l4->output_height, net->l4->output_depth, 0.0);
+    net->layers[5] = make_volume_in(net->l4->output_width, net->l4->output_height, net->l4->output_depth, 0.0, MEM_WEIGHTS);
     net->l5 = make_pool_layer(net->layers[5]->width, net->layers[5]->height, net->layers[5]->depth, 2, 2);
 
-    net->layers[6] = make_volume(net->l5->output_width, net->l5->output_height, net->l5->output_depth, 0.0);
+    net->layers[6] = make_volume_in(net->l5->output_width, net->l5->output_height, net->l5->output_depth, 0.0, MEM_WEIGHTS);
     net->l6 = make_conv_layer(net->layers[6]->width, net->layers[6]->height, net->layers[6]->depth, 5, 20, 1, 2);
 
-    net->layers[7] = make_volume(net->l6->output_width, net->l6->output_height, net->l6->output_depth, 0.0);
+    net->layers[7] = make_volume_in(net->l6->output_width, net->l6->output_height, net->l6->output_depth, 0.0, MEM_WEIGHTS);
     net->l7 = make_relu_layer(net->layers[7]->width, net->layers[7]->height, net->layers[7]->depth);
 
-    net->layers[8] = make_volume(net->l7->output_width, net->l7->output_height, net->l7->output_depth, 0.0);
+    net->layers[8] = make_volume_in(net->l7->output_width, net->l7->output_height, net->l7->output_depth, 0.0, MEM_WEIGHTS);
     net->l8 = make_pool_layer(net->layers[8]->width, net->layers[8]->height, net->layers[8]->depth, 2, 2);
 
-    net->layers[9] = make_volume(net->l8->output_width, net->l8->output_height, net->l8->output_depth, 0.0);
+    net->layers[9] = make_volume_in(net->l8->output_width, net->l8->output_height, net->l8->output_depth, 0.0, MEM_WEIGHTS);
     net->l9 = make_fc_layer(net->layers[9]->width, net->layers[9]->height, net->layers[9]->depth, 10);
 
-    net->layers[10] = make_volume(net->l9->output_width, net->l9->output_height, net->l9->output_depth, 0.0);
+    net->layers[10] = make_volume_in(net->l9->output_width, net->l9->output_height, net->l9->output_depth, 0.0, MEM_WEIGHTS);
     net->l10 = make_softmax_layer(net->layers[10]->width, net->layers[10]->height, net->layers[10]->depth);
 
-    net->layers[11] = make_volume(net->l10->output_width, net->l10->output_height, net->l10->output_depth, 0.0);
+    net->layers[11] = make_volume_in(net->l10->output_width, net->l10->output_height, net->l10->output_depth, 0.0, MEM_WEIGHTS);
+
     return net;
 }
 
@@ -97,7 +101,7 @@ batch_t *make_batch(network_t *net, int size) {
     for (int i = 0; i < NUM_LAYERS + 1; i++) {
         out[i] = (volume_t **) malloc(sizeof(volume_t *)*size);
         for (int j = 0; j < size; j++) {
-            out[i][j] = make_volume(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0);
+            out[i][j] = make_volume_in(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0, MEM_ACTIVATIONS);
         }
     }
     return out;
@@ -113,7 +117,23 @@ void free_batch(batch_t *b, int size) {
     free(b);
 }
 
+void net_set_chunk_size(int size) {
+    // The baseline classifies images serially, so there is nothing to tune.
+    assert(size > 0);
+}
+
+void net_set_result_cache(result_cache_t *cache) {
+    // The baseline always classifies every image, so it is the reference for
+    // the cached results.
+    assert(cache == NULL || cache->num_values == NUM_CLASSES);
+}
+
 void net_forward(network_t *net, batch_t *b, int start, int end) {
+    if (instrument_flags) {
+        instrument_forward(net, b, start, end);
+        return;
+    }
+
     conv_forward(net->l0, b[0], b[1], start, end);
     relu_forward(net->l1, b[1], b[2], start, end);
     pool_forward(net->l2, b[2], b[3], start, end);
@@ -127,6 +147,31 @@ void net_forward(network_t *net, batch_t *b, int start, int end) {
     softmax_forward(net->l10, b[10], b[11], start, end);
 }
 
+void net_forward_parallel(network_t *net, batch_t *b, int j, int num_threads) {
+    net_forward(net, b, j, j);
+}
+
+void net_classify_latency(network_t *net, batch_t *b, volume_t *input, double *likelihoods) {
+    bind_input(b, 0, input);
+
+    net_forward(net, b, 0, 0);
+    for (int j = 0; j < NUM_CLASSES; j++) {
+        likelihoods[j] = b[11][0]->weights[j];
+    }
+}
+
+void net_calibrate(network_t *net) {
+    // The baseline always classifies one image at a time on one thread.
+}
+
+int net_threads_per_image(int n) {
+    return 1;
+}
+
+void net_classify_adaptive(network_t *net, volume_t **input, net_output_t *out, int n) {
+    net_classify_output(net, input, out, n);
+}
+
 void net_classify(network_t *net, volume_t **input, double **likelihoods, int n) {
     batch_t *b = make_batch(net, 1);
 
@@ -139,4 +184,38 @@ void net_classify(network_t *net, volume_t **input, double **likelihoods, int n)
     }
 
     free_batch(b, 1);
+}
+
+void net_classify_output(network_t *net, volume_t **input, net_output_t *out, int n) {
+    assert(out->mode != NET_OUTPUT_TOP_K || (out->k > 0 && out->k <= NUM_CLASSES));
+
+    batch_t *b = make_batch(net, 1);
+
+    for (int i = 0; i < n; i++) {
+        copy_volume(b[0][0], input[i]);
+        net_forward(net, b, 0, 0);
+        net_store_output(out, i, b[11][0]->weights);
+    }
+
+    free_batch(b, 1);
+}
+
+long net_classify_stream(network_t *net, net_source_t source, void *source_ctx, net_sink_t sink, void *sink_ctx,
+        int window) {
+    assert(window > 0);
+    batch_t *b = make_batch(net, 1);
+    double likelihoods[NUM_CLASSES];
+
+    long done = 0;
+    while (source(source_ctx, b[0][0])) {
+        net_forward(net, b, 0, 0);
+        for (int j = 0; j < NUM_CLASSES; j++) {
+            likelihoods[j] = b[11][0]->weights[j];
+        }
+        sink(sink_ctx, done, likelihoods);
+        done++;
+    }
+
+    free_batch(b, 1);
+    return done;
 }
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "layers.h"
+#include "memtrack.h"
+#include "network.h"
+#include "volume.h"
+
+// The parts of the network that are the same for the optimized version
+// (network.c) and the baseline (network_baseline.c), so both binaries share a
+// single copy: copying networks, view batches and the per-layer and output
+// helpers. The layer kernels they call are those of whichever layers file is
+// linked in.
+
+network_t *copy_network(network_t *net) {
+    network_t *copy = make_network();
+
+    conv_layer_t *conv[] = {net->l0, net->l3, net->l6};
+    conv_layer_t *conv_copy[] = {copy->l0, copy->l3, copy->l6};
+    for (int i = 0; i < 3; i++) {
+        for (int f = 0; f < conv[i]->output_depth; f++) {
+            copy_volume(conv_copy[i]->filters[f], conv[i]->filters[f]);
+        }
+        copy_volume(conv_copy[i]->biases, conv[i]->biases);
+    }
+
+    for (int f = 0; f < net->l9->output_depth; f++) {
+        copy_volume(copy->l9->filters[f], net->l9->filters[f]);
+    }
+    copy_volume(copy->l9->biases, net->l9->biases);
+
+    return copy;
+}
+
+batch_t *make_batch_view(network_t *net, int size) {
+    batch_t *out = (batch_t*) malloc(sizeof(volume_t **) * (NUM_LAYERS + 1));
+    out[0] = (volume_t **) malloc(sizeof(volume_t *)*size);
+    for (int j = 0; j < size; j++) {
+        out[0][j] = make_volume_view(net->layers[0]->width, net->layers[0]->height, net->layers[0]->depth, NULL);
+    }
+    for (int i = 1; i < NUM_LAYERS + 1; i++) {
+        out[i] = (volume_t **) malloc(sizeof(volume_t *)*size);
+        for (int j = 0; j < size; j++) {
+            out[i][j] = make_volume_in(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0, MEM_ACTIVATIONS);
+        }
+    }
+    return out;
+}
+
+void free_batch_view(batch_t *b, int size) {
+    for (int j = 0; j < size; j++) {
+        free_volume_view(b[0][j]);
+    }
+    free(b[0]);
+    for (int i = 1; i < NUM_LAYERS + 1; i++) {
+        for (int j = 0; j < size; j++) {
+            free_volume(b[i][j]);
+        }
+        free(b[i]);
+    }
+    free(b);
+}
+
+void bind_input(batch_t *b, int j, volume_t *input) {
+    assert(b[0][j]->width == input->width);
+    assert(b[0][j]->height == input->height);
+    assert(b[0][j]->depth == input->depth);
+    b[0][j]->weights = input->weights;
+}
+
+void net_forward_layers(network_t *net, batch_t *b, int first, int last, int start, int end) {
+    assert(first >= 0 && first <= last && last <= NUM_LAYERS);
+
+    for (int l = first; l < last; l++) {
+        switch (l) {
+            case 0: conv_forward(net->l0, b[0], b[1], start, end); break;
+            case 1: relu_forward(net->l1, b[1], b[2], start, end); break;
+            case 2: pool_forward(net->l2, b[2], b[3], start, end); break;
+            case 3: conv_forward(net->l3, b[3], b[4], start, end); break;
+            case 4: relu_forward(net->l4, b[4], b[5], start, end); break;
+            case 5: pool_forward(net->l5, b[5], b[6], start, end); break;
+            case 6: conv_forward(net->l6, b[6], b[7], start, end); break;
+            case 7: relu_forward(net->l7, b[7], b[8], start, end); break;
+            case 8: pool_forward(net->l8, b[8], b[9], start, end); break;
+            case 9: fc_forward(net->l9, b[9], b[10], start, end); break;
+            case 10: softmax_forward(net->l10, b[10], b[11], start, end); break;
+        }
+    }
+}
+
+void net_store_output(net_output_t *out, int i, double *likelihoods) {
+    switch (out->mode) {
+        case NET_OUTPUT_DOUBLE:
+            for (int c = 0; c < NUM_CLASSES; c++) {
+                out->likelihoods[i * NUM_CLASSES + c] = likelihoods[c];
+            }
+            break;
+        case NET_OUTPUT_FLOAT:
+            for (int c = 0; c < NUM_CLASSES; c++) {
+                out->likelihoods_f[i * NUM_CLASSES + c] = (float) likelihoods[c];
+            }
+            break;
+        case NET_OUTPUT_TOP_K: {
+            // Insertion sort into the (short) list of the k best classes.
+            int *classes = out->classes + i * out->k;
+            double *scores = out->scores + i * out->k;
+            int size = 0;
+            for (int c = 0; c < NUM_CLASSES; c++) {
+                int pos = size < out->k ? size : out->k;
+                while (pos > 0 && scores[pos - 1] < likelihoods[c]) {
+                    pos--;
+                }
+                if (pos == out->k) {
+                    continue;
+                }
+                for (int j = (size < out->k ? size : out->k - 1); j > pos; j--) {
+                    classes[j] = classes[j - 1];
+                    scores[j] = scores[j - 1];
+                }
+                classes[pos] = c;
+                scores[pos] = likelihoods[c];
+                if (size < out->k) {
+                    size++;
+                }
+            }
+            break;
+        }
+    }
+}
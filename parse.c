@@ -0,0 +1,408 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Include OpenMP
+#include <omp.h>
+
+#include "parse.h"
+
+// Range of decimal exponents covered by the table of powers of ten. Anything
+// outside of it is passed on to strtod().
+#define POW10_MIN_EXP (-348)
+#define POW10_MAX_EXP 347
+
+// Number of 32-bit limbs needed to hold 2 * 10^348 exactly.
+#define BIG_LIMBS 40
+
+// Files smaller than this are not worth splitting across several threads.
+#define MIN_CHUNK_SIZE 4096
+
+// 128-bit approximations (rounded down) of the powers of ten, normalized so
+// that the most significant bit is set. pow10_table[e - POW10_MIN_EXP][1]
+// holds the high and [0] the low 64 bits of 10^e.
+static uint64_t pow10_table[POW10_MAX_EXP - POW10_MIN_EXP + 1][2];
+static int pow10_ready = 0;
+
+// Powers of ten that are exactly representable as doubles.
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline int is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Minimal little-endian big integers, just enough to build pow10_table.
+static int big_bit_length(const uint32_t *a) {
+    for (int i = BIG_LIMBS - 1; i >= 0; i--) {
+        if (a[i] != 0) {
+            return i * 32 + 32 - __builtin_clz(a[i]);
+        }
+    }
+    return 0;
+}
+
+static inline int big_bit(const uint32_t *a, int pos) {
+    return (a[pos / 32] >> (pos % 32)) & 1;
+}
+
+static void big_mul_small(uint32_t *a, uint32_t m) {
+    uint64_t carry = 0;
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        uint64_t v = (uint64_t) a[i] * m + carry;
+        a[i] = (uint32_t) v;
+        carry = v >> 32;
+    }
+    assert(carry == 0);
+}
+
+static void big_shift_left_one(uint32_t *a) {
+    for (int i = BIG_LIMBS - 1; i > 0; i--) {
+        a[i] = (a[i] << 1) | (a[i - 1] >> 31);
+    }
+    a[0] <<= 1;
+}
+
+static int big_compare(const uint32_t *a, const uint32_t *b) {
+    for (int i = BIG_LIMBS - 1; i >= 0; i--) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static void big_sub(uint32_t *a, const uint32_t *b) {
+    uint64_t borrow = 0;
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        uint64_t v = (uint64_t) a[i] - b[i] - borrow;
+        a[i] = (uint32_t) v;
+        borrow = (v >> 32) & 1;
+    }
+}
+
+static void build_pow10_table(void) {
+    uint32_t pow[BIG_LIMBS];
+    uint32_t rem[BIG_LIMBS];
+
+    // Non-negative exponents: the leading 128 bits of 10^e.
+    memset(pow, 0, sizeof(pow));
+    pow[0] = 1;
+    for (int e = 0; e <= POW10_MAX_EXP; e++) {
+        int len = big_bit_length(pow);
+        uint64_t hi = 0, lo = 0;
+        for (int i = 0; i < 128; i++) {
+            int pos = len - 1 - i;
+            uint64_t bit = pos >= 0 ? big_bit(pow, pos) : 0;
+            hi = (hi << 1) | (lo >> 63);
+            lo = (lo << 1) | bit;
+        }
+        pow10_table[e - POW10_MIN_EXP][0] = lo;
+        pow10_table[e - POW10_MIN_EXP][1] = hi;
+        big_mul_small(pow, 10);
+    }
+
+    // Negative exponents: floor(2^(len + 127) / 10^-e), where len is the bit
+    // length of 10^-e, computed with a bitwise long division.
+    memset(pow, 0, sizeof(pow));
+    pow[0] = 10;
+    for (int e = -1; e >= POW10_MIN_EXP; e--) {
+        int len = big_bit_length(pow);
+        memset(rem, 0, sizeof(rem));
+        rem[(len - 1) / 32] = 1u << ((len - 1) % 32);
+
+        uint64_t hi = 0, lo = 0;
+        for (int i = 0; i < 128; i++) {
+            big_shift_left_one(rem);
+            hi = (hi << 1) | (lo >> 63);
+            lo <<= 1;
+            if (big_compare(rem, pow) >= 0) {
+                big_sub(rem, pow);
+                lo |= 1;
+            }
+        }
+        pow10_table[e - POW10_MIN_EXP][0] = lo;
+        pow10_table[e - POW10_MIN_EXP][1] = hi;
+        big_mul_small(pow, 10);
+    }
+}
+
+static void init_pow10_table(void) {
+    int ready;
+#pragma omp atomic read
+    ready = pow10_ready;
+#pragma omp flush
+    if (ready) {
+        return;
+    }
+
+#pragma omp critical (pow10_table)
+    {
+        if (!pow10_ready) {
+            build_pow10_table();
+#pragma omp flush
+#pragma omp atomic write
+            pow10_ready = 1;
+        }
+    }
+}
+
+// Computes mantissa * 10^exp10 with the Eisel-Lemire algorithm. Returns 0 if
+// the result cannot be decided from the 128-bit approximation of the power of
+// ten (or would be subnormal or infinite), in which case the caller has to
+// fall back to an exact conversion.
+static int eisel_lemire(uint64_t mantissa, int exp10, double *out) {
+    if (exp10 < POW10_MIN_EXP || exp10 > POW10_MAX_EXP) {
+        return 0;
+    }
+
+    // Normalize the mantissa so that its most significant bit is set.
+    int clz = __builtin_clzll(mantissa);
+    mantissa <<= clz;
+    uint64_t ret_exp2 = (uint64_t) (((217706 * exp10) >> 16) + 64 + 1023) - (uint64_t) clz;
+
+    const uint64_t *pow = pow10_table[exp10 - POW10_MIN_EXP];
+    unsigned __int128 x = (unsigned __int128) mantissa * pow[1];
+    uint64_t x_hi = (uint64_t) (x >> 64);
+    uint64_t x_lo = (uint64_t) x;
+
+    // The low bits are all ones: the truncated part of the power of ten might
+    // carry into them, so take the low 64 bits of the power into account too.
+    if ((x_hi & 0x1FF) == 0x1FF && x_lo + mantissa < mantissa) {
+        unsigned __int128 y = (unsigned __int128) mantissa * pow[0];
+        uint64_t y_hi = (uint64_t) (y >> 64);
+        uint64_t y_lo = (uint64_t) y;
+        uint64_t merged_hi = x_hi;
+        uint64_t merged_lo = x_lo + y_hi;
+        if (merged_lo < x_lo) {
+            merged_hi++;
+        }
+        if ((merged_hi & 0x1FF) == 0x1FF && merged_lo + 1 == 0 && y_lo + mantissa < mantissa) {
+            return 0;
+        }
+        x_hi = merged_hi;
+        x_lo = merged_lo;
+    }
+
+    // Keep 54 bits, one more than a double has, for rounding.
+    uint64_t msb = x_hi >> 63;
+    uint64_t ret_mantissa = x_hi >> (msb + 9);
+    ret_exp2 -= 1 ^ msb;
+
+    // Exactly half-way between two doubles: cannot tell which way to round.
+    if (x_lo == 0 && (x_hi & 0x1FF) == 0 && (ret_mantissa & 3) == 1) {
+        return 0;
+    }
+
+    ret_mantissa += ret_mantissa & 1;
+    ret_mantissa >>= 1;
+    if (ret_mantissa >> 53 > 0) {
+        ret_mantissa >>= 1;
+        ret_exp2 += 1;
+    }
+
+    // Subnormal, infinite or NaN results are left to strtod().
+    if (ret_exp2 - 1 >= 0x7FF - 1) {
+        return 0;
+    }
+
+    uint64_t bits = (ret_exp2 << 52) | (ret_mantissa & 0x000FFFFFFFFFFFFFull);
+    memcpy(out, &bits, sizeof(bits));
+    return 1;
+}
+
+double parse_double(const char *str, const char **end) {
+    init_pow10_table();
+
+    const char *p = str;
+    int neg = 0;
+    if (*p == '-' || *p == '+') {
+        neg = (*p == '-');
+        p++;
+    }
+
+    // Keep at most 19 significant digits, which always fit into 64 bits, and
+    // remember whether any of the dropped digits was non-zero.
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exp10 = 0;
+    int truncated = 0;
+    int seen_digit = 0;
+
+    for (; *p >= '0' && *p <= '9'; p++) {
+        int digit = *p - '0';
+        seen_digit = 1;
+        if (mantissa == 0 && digit == 0) {
+            continue;
+        }
+        if (digits < 19) {
+            mantissa = mantissa * 10 + digit;
+            digits++;
+        } else {
+            exp10++;
+            truncated |= (digit != 0);
+        }
+    }
+
+    if (*p == '.') {
+        p++;
+        for (; *p >= '0' && *p <= '9'; p++) {
+            int digit = *p - '0';
+            seen_digit = 1;
+            if (mantissa == 0 && digit == 0) {
+                exp10--;
+            } else if (digits < 19) {
+                mantissa = mantissa * 10 + digit;
+                digits++;
+                exp10--;
+            } else {
+                truncated |= (digit != 0);
+            }
+        }
+    }
+
+    if (seen_digit && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        int exp_neg = 0;
+        if (*q == '-' || *q == '+') {
+            exp_neg = (*q == '-');
+            q++;
+        }
+        if (*q >= '0' && *q <= '9') {
+            int e = 0;
+            for (; *q >= '0' && *q <= '9'; q++) {
+                if (e < 100000) {
+                    e = e * 10 + (*q - '0');
+                }
+            }
+            exp10 += exp_neg ? -e : e;
+            p = q;
+        }
+    }
+
+    // Hex floats, inf, nan and anything else unusual are left to strtod().
+    if (!seen_digit || !(is_space(*p) || *p == '\0')) {
+        return strtod(str, (char **) end);
+    }
+
+    *end = p;
+
+    if (mantissa == 0) {
+        return neg ? -0.0 : 0.0;
+    }
+
+    double value;
+
+    // Both the mantissa and the power of ten are exact doubles, so a single
+    // (correctly rounded) operation gives the correctly rounded result.
+    if (!truncated && mantissa <= (1ull << 53) && exp10 >= -22 && exp10 <= 22) {
+        value = (double) mantissa;
+        value = exp10 < 0 ? value / exact_pow10[-exp10] : value * exact_pow10[exp10];
+        return neg ? -value : value;
+    }
+
+    // If digits were dropped, the exact value lies between mantissa and
+    // mantissa + 1 (times 10^exp10), so both bounds have to round the same way.
+    if (eisel_lemire(mantissa, exp10, &value)) {
+        double upper;
+        if (!truncated || (eisel_lemire(mantissa + 1, exp10, &upper) && upper == value)) {
+            return neg ? -value : value;
+        }
+    }
+
+    return strtod(str, (char **) end);
+}
+
+// Counts the numbers that start within text[lo, hi). A number belongs to the
+// chunk in which its first character lies.
+static int count_numbers(const char *text, long lo, long hi) {
+    int count = 0;
+    for (long i = lo; i < hi; i++) {
+        if (!is_space(text[i]) && (i == 0 || is_space(text[i - 1]))) {
+            count++;
+        }
+    }
+    return count;
+}
+
+double *parse_number_file(const char *file_name, int *header, int num_header, int *count) {
+    FILE *fin = fopen(file_name, "rb");
+    assert(fin != NULL);
+
+    fseek(fin, 0, SEEK_END);
+    long size = ftell(fin);
+    fseek(fin, 0, SEEK_SET);
+
+    char *text = malloc(size + 1);
+    assert(fread(text, 1, size, fin) == (size_t) size);
+    text[size] = '\0';
+    fclose(fin);
+
+    char *p = text;
+    for (int i = 0; i < num_header; i++) {
+        char *next;
+        header[i] = (int) strtol(p, &next, 10);
+        assert(next != p);
+        p = next;
+    }
+    assert(is_space(*p) || *p == '\0');
+    long body = p - text;
+
+    // Build the table up front instead of inside the parallel region.
+    init_pow10_table();
+
+    int num_chunks = omp_get_max_threads();
+    if (num_chunks > (size - body) / MIN_CHUNK_SIZE + 1) {
+        num_chunks = (size - body) / MIN_CHUNK_SIZE + 1;
+    }
+
+    long bounds[num_chunks + 1];
+    int offsets[num_chunks + 1];
+    for (int c = 0; c <= num_chunks; c++) {
+        bounds[c] = body + (size - body) * c / num_chunks;
+    }
+
+    // First pass: count the numbers in every chunk to find where each chunk's
+    // values go in the output array.
+    offsets[0] = 0;
+#pragma omp parallel for
+    for (int c = 0; c < num_chunks; c++) {
+        offsets[c + 1] = count_numbers(text, bounds[c], bounds[c + 1]);
+    }
+    for (int c = 0; c < num_chunks; c++) {
+        offsets[c + 1] += offsets[c];
+    }
+
+    double *values = malloc(sizeof(double) * (offsets[num_chunks] > 0 ? offsets[num_chunks] : 1));
+
+    // Second pass: parse every chunk.
+#pragma omp parallel for
+    for (int c = 0; c < num_chunks; c++) {
+        const char *q = text + bounds[c];
+
+        // Skip the tail of a number that started in the previous chunk.
+        if (bounds[c] > 0 && !is_space(q[-1])) {
+            while (*q != '\0' && !is_space(*q)) {
+                q++;
+            }
+        }
+
+        for (int k = offsets[c]; k < offsets[c + 1]; k++) {
+            while (is_space(*q)) {
+                q++;
+            }
+            const char *next;
+            values[k] = parse_double(q, &next);
+            assert(next != q && (is_space(*next) || *next == '\0'));
+            q = next;
+        }
+    }
+
+    *count = offsets[num_chunks];
+    free(text);
+    return values;
+}
@@ -0,0 +1,20 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+// Helpers for reading the text format of the files in snapshot/. Each file is
+// a list of whitespace-separated numbers: a few integers describing the shape
+// of the layer, followed by all of its weights as decimal doubles.
+
+// Parses one decimal number starting at str and stores a pointer to the first
+// character after it in *end. The result is bit-identical to strtod(): common
+// inputs are converted with the Eisel-Lemire algorithm, and anything it cannot
+// decide exactly (or does not recognize) is handed to strtod() itself.
+double parse_double(const char *str, const char **end);
+
+// Reads the whole file in one go. The first num_header numbers are parsed as
+// integers into header, the remaining numbers are parsed in parallel as
+// doubles. Returns a newly allocated array with the doubles (in file order)
+// and stores how many there are in *count.
+double *parse_number_file(const char *file_name, int *header, int num_header, int *count);
+
+#endif
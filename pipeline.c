@@ -0,0 +1,184 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "affinity.h"
+#include "instrument.h"
+#include "latency.h"
+#include "network.h"
+#include "pipeline.h"
+#include "volume.h"
+
+// Number of times a stage polls an empty (or full) ring before it gives up the
+// CPU. Keeps the hand-off fast when every stage has its own core, without
+// starving the other stages when they have to share one.
+#define SPIN_LIMIT 64
+
+static const int default_stage_start[PIPELINE_DEFAULT_STAGES] = {0, 3, 6};
+
+static void ring_init(spsc_ring_t *r, int capacity) {
+    unsigned long size = 1;
+    while (size < (unsigned long) capacity) {
+        size <<= 1;
+    }
+    r->items = (void **) malloc(sizeof(void *) * size);
+    r->mask = size - 1;
+    r->head = 0;
+    r->tail = 0;
+}
+
+static inline void ring_wait(int *spins) {
+    if (++*spins < SPIN_LIMIT) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        _mm_pause();
+#endif
+    } else {
+        *spins = 0;
+        sched_yield();
+    }
+}
+
+// Called by the producer only.
+static void ring_push(spsc_ring_t *r, void *item) {
+    unsigned long tail = r->tail;
+    int spins = 0;
+    while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask) {
+        ring_wait(&spins);
+    }
+    r->items[tail & r->mask] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Called by the consumer only.
+static void *ring_pop(spsc_ring_t *r) {
+    unsigned long head = r->head;
+    int spins = 0;
+    while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+        ring_wait(&spins);
+    }
+    void *item = r->items[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+static void *pipeline_stage(void *arg) {
+    pipeline_stage_t *st = (pipeline_stage_t *) arg;
+    pipeline_t *p = st->pipeline;
+    int last_stage = st->index == p->num_stages - 1;
+
+    pin_to_cpu(st->cpu);
+
+    // Every stage sees every image exactly once, in input order.
+    for (int i = 0; i < p->n; i++) {
+        pipeline_slot_t *slot;
+        if (st->index == 0) {
+            slot = (pipeline_slot_t *) ring_pop(&p->rings[p->num_stages - 1]);
+            slot->image = i;
+            slot->begin = instrument_flags ? instrument_now() : 0;
+            bind_input(slot->b, 0, p->input[i]);
+        } else {
+            slot = (pipeline_slot_t *) ring_pop(&p->rings[st->index - 1]);
+        }
+
+        net_forward_layers(p->net, slot->b, st->first, st->last, 0, 0);
+
+        if (last_stage) {
+            net_store_output(p->out, slot->image, slot->b[NUM_LAYERS][0]->weights);
+            if (instrument_flags) {
+                instrument_pass(slot->begin, LATENCY_PIPELINE, 1);
+            }
+        }
+        ring_push(&p->rings[st->index], slot);
+    }
+
+    return NULL;
+}
+
+pipeline_t *make_pipeline(network_t *net, int num_stages, const int *stage_start, int depth) {
+    if (stage_start == NULL) {
+        assert(num_stages == PIPELINE_DEFAULT_STAGES);
+        stage_start = default_stage_start;
+    }
+    assert(num_stages > 0 && num_stages <= NUM_LAYERS);
+    assert(stage_start[0] == 0);
+
+    pipeline_t *p = (pipeline_t *) malloc(sizeof(pipeline_t));
+    p->net = net;
+    p->num_stages = num_stages;
+    p->num_slots = depth > 0 ? depth : 2 * num_stages;
+
+    p->stages = (pipeline_stage_t *) malloc(sizeof(pipeline_stage_t) * num_stages);
+    for (int s = 0; s < num_stages; s++) {
+        pipeline_stage_t *st = &p->stages[s];
+        st->pipeline = p;
+        st->index = s;
+        st->first = stage_start[s];
+        st->last = s + 1 < num_stages ? stage_start[s + 1] : NUM_LAYERS;
+        st->cpu = allowed_cpu(s);
+        assert(st->first < st->last);
+    }
+
+    // Every ring is large enough to hold all slots, so a push never waits.
+    p->rings = (spsc_ring_t *) malloc(sizeof(spsc_ring_t) * num_stages);
+    for (int s = 0; s < num_stages; s++) {
+        ring_init(&p->rings[s], p->num_slots);
+    }
+
+    p->slots = (pipeline_slot_t *) malloc(sizeof(pipeline_slot_t) * p->num_slots);
+    for (int k = 0; k < p->num_slots; k++) {
+        p->slots[k].b = make_batch_view(net, 1);
+    }
+
+    return p;
+}
+
+void free_pipeline(pipeline_t *p) {
+    for (int k = 0; k < p->num_slots; k++) {
+        free_batch_view(p->slots[k].b, 1);
+    }
+    for (int s = 0; s < p->num_stages; s++) {
+        free(p->rings[s].items);
+    }
+    free(p->slots);
+    free(p->rings);
+    free(p->stages);
+    free(p);
+}
+
+void pipeline_classify(pipeline_t *p, volume_t **input, net_output_t *out, int n) {
+    assert(out->mode != NET_OUTPUT_TOP_K || (out->k > 0 && out->k <= NUM_CLASSES));
+
+    p->input = input;
+    p->out = out;
+    p->n = n;
+
+    // All slots start out free, waiting for the first stage. The rings are
+    // only touched here while no stage thread is running.
+    spsc_ring_t *free_slots = &p->rings[p->num_stages - 1];
+    for (int s = 0; s < p->num_stages; s++) {
+        p->rings[s].head = 0;
+        p->rings[s].tail = 0;
+    }
+    for (int k = 0; k < p->num_slots; k++) {
+        ring_push(free_slots, &p->slots[k]);
+    }
+
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * p->num_stages);
+    for (int s = 0; s < p->num_stages; s++) {
+        int err = pthread_create(&threads[s], NULL, pipeline_stage, &p->stages[s]);
+        assert(err == 0);
+    }
+    for (int s = 0; s < p->num_stages; s++) {
+        pthread_join(threads[s], NULL);
+    }
+    free(threads);
+}
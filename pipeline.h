@@ -0,0 +1,81 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <inttypes.h>
+
+#include "network.h"
+#include "volume.h"
+
+// Layer-pipeline execution: the layers of the network are split into a few
+// consecutive stages, and every stage runs on its own thread, pinned to its
+// own CPU. Images flow from stage to stage, so each thread only ever touches
+// the weights of its own layers and those stay in its cache. The stages are
+// connected by lock-free single-producer/single-consumer rings that pass
+// around a fixed set of slots, each holding the activations of one image.
+
+// Default split into stages: l0-l2, l3-l5 and l6-l10.
+#define PIPELINE_DEFAULT_STAGES 3
+
+// A lock-free ring buffer with exactly one producer and one consumer thread.
+// The producer only writes tail, the consumer only writes head, and the two
+// live on separate cache lines so they do not bounce between the cores.
+typedef struct spsc_ring {
+    void **items;
+    unsigned long mask;
+    char pad0[64];
+    unsigned long head;
+    char pad1[64];
+    unsigned long tail;
+    char pad2[64];
+} spsc_ring_t;
+
+// One in-flight image: its position in the input, its activations and when it
+// entered the first stage (only while instrumentation is enabled).
+typedef struct pipeline_slot {
+    batch_t *b;
+    int image;
+    uint64_t begin;
+} pipeline_slot_t;
+
+typedef struct pipeline_stage {
+    struct pipeline *pipeline;
+    int index;
+
+    // Layers first to last - 1 are applied by this stage.
+    int first;
+    int last;
+    int cpu;
+} pipeline_stage_t;
+
+typedef struct pipeline {
+    network_t *net;
+    int num_stages;
+    pipeline_stage_t *stages;
+
+    // ring[s] connects stage s to stage s + 1. The last ring returns finished
+    // slots from the last stage to the first one.
+    spsc_ring_t *rings;
+    int num_slots;
+    pipeline_slot_t *slots;
+
+    // The current call to pipeline_classify.
+    volume_t **input;
+    net_output_t *out;
+    int n;
+} pipeline_t;
+
+// Creates a pipeline for net with num_stages stages, where stage s starts at
+// layer stage_start[s] (stage_start[0] has to be 0 and the starts have to be
+// increasing). If stage_start is NULL, the default split is used, which
+// requires num_stages to be PIPELINE_DEFAULT_STAGES. At most depth images are
+// in flight at a time (2 per stage if depth is 0 or less).
+pipeline_t *make_pipeline(network_t *net, int num_stages, const int *stage_start, int depth);
+
+// Frees a pipeline (but not its network).
+void free_pipeline(pipeline_t *p);
+
+// Classifies n images by streaming them through the pipeline. The results are
+// the same as those of net_classify_output.
+void pipeline_classify(pipeline_t *p, volume_t **input, net_output_t *out, int n);
+
+#endif
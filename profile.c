@@ -0,0 +1,370 @@
+// Needed for clock_gettime, posix_memalign and syscall.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+#include "instrument.h"
+#include "layers.h"
+#include "network.h"
+#include "profile.h"
+#include "volume.h"
+
+int profile_enabled = 0;
+
+// Whether hardware counters are read, and the first error perf_event_open
+// returned (0 if none).
+static int hardware_enabled = 0;
+static int open_error = 0;
+
+typedef struct profile_event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int intel_only;
+} profile_event_t;
+
+static const profile_event_t hardware_events[PROFILE_NUM_EVENTS] = {
+    {"CYCLES", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0},
+    {"INSTR", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0},
+    {"L1D-MISS", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), 0},
+    {"LLC-MISS", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), 0},
+    {"BR-MISS", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0},
+    // FP_ARITH_INST_RETIRED for scalar, 128-bit and 256-bit doubles. This
+    // counts instructions (not operations) and only exists on Intel CPUs
+    // since Broadwell.
+    {"FP-INSTR", PERF_TYPE_RAW, 0x15c7, 1},
+};
+
+static int is_intel(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    // "GenuineIntel"
+    return ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e;
+#else
+    return 0;
+#endif
+}
+
+// Opens the hardware counters of the calling thread as one group, so they are
+// always scheduled (and read) together. Events that cannot be opened are left
+// out.
+static void open_counters(profile_counters_t *c) {
+    c->group_fd = -1;
+    c->num_group_events = 0;
+    for (int e = 0; e < PROFILE_NUM_EVENTS; e++) {
+        c->event_fd[e] = -1;
+        c->event_index[e] = -1;
+        c->events_available[e] = 0;
+    }
+    if (!hardware_enabled) {
+        return;
+    }
+
+    int intel = is_intel();
+    for (int e = 0; e < PROFILE_NUM_EVENTS; e++) {
+        if (hardware_events[e].intel_only && !intel) {
+            continue;
+        }
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = hardware_events[e].type;
+        attr.config = hardware_events[e].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = c->group_fd < 0;
+
+        int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, c->group_fd, 0);
+        if (fd < 0) {
+            __atomic_compare_exchange_n(&open_error, &(int) {0}, errno, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (c->group_fd < 0) {
+            c->group_fd = fd;
+        }
+        c->event_fd[e] = fd;
+        c->event_index[e] = c->num_group_events++;
+        c->events_available[e] = 1;
+    }
+
+    if (c->group_fd >= 0) {
+        ioctl(c->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+// Reads the hardware counters of the calling thread into stamp.
+static void read_counters(profile_counters_t *c, profile_stamp_t *stamp) {
+    stamp->has_events = 0;
+    if (c->group_fd < 0) {
+        return;
+    }
+
+    // Layout of a group read: nr, time enabled, time running, nr values.
+    uint64_t buffer[3 + PROFILE_NUM_EVENTS];
+    ssize_t size = sizeof(uint64_t) * (3 + c->num_group_events);
+    if (read(c->group_fd, buffer, size) != size) {
+        return;
+    }
+    stamp->enabled = buffer[1];
+    stamp->running = buffer[2];
+    for (int i = 0; i < c->num_group_events; i++) {
+        stamp->events[i] = buffer[3 + i];
+    }
+    stamp->has_events = 1;
+}
+
+// The counters of all threads that have ever recorded anything. They are kept
+// after the thread exits, so they can still be reported.
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_counters_t *all_counters = NULL;
+static __thread profile_counters_t *thread_counters = NULL;
+
+static profile_counters_t *local_counters(void) {
+    if (thread_counters == NULL) {
+        // Cache line aligned, so the counters of different threads never
+        // share a line.
+        void *memory;
+        if (posix_memalign(&memory, 64, sizeof(profile_counters_t)) != 0) {
+            abort();
+        }
+        thread_counters = (profile_counters_t *) memory;
+        memset(thread_counters, 0, sizeof(profile_counters_t));
+        open_counters(thread_counters);
+
+        pthread_mutex_lock(&counters_lock);
+        thread_counters->next = all_counters;
+        all_counters = thread_counters;
+        pthread_mutex_unlock(&counters_lock);
+    }
+    return thread_counters;
+}
+
+void profile_enable(int enabled, int hardware_counters) {
+    // Threads that have already opened (or failed to open) their counters
+    // keep them.
+    hardware_enabled = enabled && hardware_counters;
+    profile_enabled = enabled;
+    instrument_set(INSTRUMENT_PROFILE, enabled);
+}
+
+void profile_reset(void) {
+    pthread_mutex_lock(&counters_lock);
+    for (profile_counters_t *c = all_counters; c != NULL; c = c->next) {
+        memset(c->ns, 0, sizeof(c->ns));
+        memset(c->cycles, 0, sizeof(c->cycles));
+        memset(c->images, 0, sizeof(c->images));
+        memset(c->events, 0, sizeof(c->events));
+        memset(c->event_images, 0, sizeof(c->event_images));
+    }
+    pthread_mutex_unlock(&counters_lock);
+}
+
+// Reads the clocks (but not the hardware counters) into stamp.
+static void read_clocks(profile_stamp_t *stamp) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stamp->ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    stamp->cycles = __rdtsc();
+#else
+    stamp->cycles = 0;
+#endif
+}
+
+profile_stamp_t profile_start(void) {
+    profile_stamp_t stamp;
+    read_clocks(&stamp);
+    // Read last (and first in profile_stop), so the hardware counters do not
+    // include the clocks.
+    read_counters(local_counters(), &stamp);
+    return stamp;
+}
+
+void profile_stop(int layer, profile_stamp_t start, int images) {
+    profile_counters_t *c = local_counters();
+    profile_stamp_t now;
+    read_counters(c, &now);
+    read_clocks(&now);
+
+    c->ns[layer] += now.ns - start.ns;
+    c->cycles[layer] += now.cycles - start.cycles;
+    c->images[layer] += images;
+
+    // If the group had to share the hardware with other events, it was only
+    // counting part of the time, so scale the counts up accordingly.
+    if (start.has_events && now.has_events && now.running > start.running) {
+        double scale = (double) (now.enabled - start.enabled) / (now.running - start.running);
+        for (int e = 0; e < PROFILE_NUM_EVENTS; e++) {
+            int i = c->event_index[e];
+            if (i >= 0) {
+                c->events[layer][e] += (now.events[i] - start.events[i]) * scale;
+            }
+        }
+        c->event_images[layer] += images;
+    }
+}
+
+// Computes the floating point operations and the bytes that have to be moved
+// at least (input, output and weights) for one image in layer l.
+static const char *layer_cost(network_t *net, int l, double *flops, double *bytes) {
+    volume_t *in = net->layers[l];
+    volume_t *out = net->layers[l + 1];
+    double in_size = (double) in->width * in->height * in->depth;
+    double out_size = (double) out->width * out->height * out->depth;
+    double weights = 0;
+    const char *type;
+
+    switch (l) {
+        case 0:
+        case 3:
+        case 6: {
+            conv_layer_t *c = l == 0 ? net->l0 : l == 3 ? net->l3 : net->l6;
+            double filter_size = (double) c->filter_width * c->filter_height * c->input_depth;
+            // A multiply and an add per filter weight, plus the bias.
+            *flops = out_size * (2 * filter_size + 1);
+            weights = c->output_depth * (filter_size + 1);
+            type = "conv";
+            break;
+        }
+        case 1:
+        case 4:
+        case 7:
+            *flops = out_size;
+            type = "relu";
+            break;
+        case 2:
+        case 5:
+        case 8: {
+            pool_layer_t *p = l == 2 ? net->l2 : l == 5 ? net->l5 : net->l8;
+            *flops = out_size * p->pool_width * p->pool_height;
+            type = "pool";
+            break;
+        }
+        case 9:
+            *flops = net->l9->output_depth * (2.0 * net->l9->num_inputs + 1);
+            weights = net->l9->output_depth * (net->l9->num_inputs + 1.0);
+            type = "fc";
+            break;
+        default:
+            // Maximum, exponential, sum and division for every class.
+            *flops = 4 * out_size;
+            type = "softmax";
+            break;
+    }
+
+    *bytes = sizeof(double) * (in_size + out_size + weights);
+    return type;
+}
+
+void profile_report(network_t *net) {
+    uint64_t ns[NUM_LAYERS] = {0};
+    uint64_t cycles[NUM_LAYERS] = {0};
+    long images[NUM_LAYERS] = {0};
+    uint64_t total_ns = 0;
+
+    pthread_mutex_lock(&counters_lock);
+    for (profile_counters_t *c = all_counters; c != NULL; c = c->next) {
+        for (int l = 0; l < NUM_LAYERS; l++) {
+            ns[l] += c->ns[l];
+            cycles[l] += c->cycles[l];
+            images[l] += c->images[l];
+        }
+    }
+    pthread_mutex_unlock(&counters_lock);
+
+    for (int l = 0; l < NUM_LAYERS; l++) {
+        total_ns += ns[l];
+    }
+
+    printf("%-6s %-8s %12s %7s %14s %9s %12s\n", "LAYER", "TYPE", "TIME(ms)", "SHARE", "CYCLES/IMAGE", "GFLOP/S",
+           "MB MOVED");
+    for (int l = 0; l < NUM_LAYERS; l++) {
+        double flops, bytes;
+        const char *type = layer_cost(net, l, &flops, &bytes);
+        double seconds = ns[l] * 1e-9;
+        printf("%-6d %-8s %12.3f %6.1f%% %14.0f %9.3f %12.3f\n", l, type, ns[l] * 1e-6,
+               total_ns > 0 ? 100.0 * ns[l] / total_ns : 0.0,
+               images[l] > 0 ? (double) cycles[l] / images[l] : 0.0,
+               seconds > 0 ? flops * images[l] / seconds * 1e-9 : 0.0,
+               bytes * images[l] * 1e-6);
+    }
+    printf("%-6s %-8s %12.3f\n", "total", "", total_ns * 1e-6);
+
+    if (!hardware_enabled) {
+        return;
+    }
+
+    double events[NUM_LAYERS][PROFILE_NUM_EVENTS] = {{0}};
+    long event_images[NUM_LAYERS] = {0};
+    int available[PROFILE_NUM_EVENTS] = {0};
+    int any_available = 0;
+
+    pthread_mutex_lock(&counters_lock);
+    for (profile_counters_t *c = all_counters; c != NULL; c = c->next) {
+        for (int e = 0; e < PROFILE_NUM_EVENTS; e++) {
+            available[e] |= c->events_available[e];
+            any_available |= c->events_available[e];
+        }
+        for (int l = 0; l < NUM_LAYERS; l++) {
+            event_images[l] += c->event_images[l];
+            for (int e = 0; e < PROFILE_NUM_EVENTS; e++) {
+                events[l][e] += c->events[l][e];
+            }
+        }
+    }
+    pthread_mutex_unlock(&counters_lock);
+
+    if (!any_available) {
+        printf("Hardware counters: not available (perf_event_open: %s)\n",
+               open_error != 0 ? strerror(open_error) : "no events");
+        return;
+    }
+
+    printf("Hardware counters per image:\n");
+    printf("%-6s %-8s", "LAYER", "TYPE");
+    for (int e = 0; e < PROFILE_NUM_EVENTS; e++) {
+        printf(" %12s", hardware_events[e].name);
+    }
+    printf(" %6s\n", "IPC");
+    for (int l = 0; l < NUM_LAYERS; l++) {
+        double flops, bytes;
+        printf("%-6d %-8s", l, layer_cost(net, l, &flops, &bytes));
+        for (int e = 0; e < PROFILE_NUM_EVENTS; e++) {
+            if (available[e] && event_images[l] > 0) {
+                printf(" %12.0f", events[l][e] / event_images[l]);
+            } else {
+                printf(" %12s", "n/a");
+            }
+        }
+        if (available[PROFILE_CYCLES] && available[PROFILE_INSTRUCTIONS] && events[l][PROFILE_CYCLES] > 0) {
+            printf(" %6.2f\n", events[l][PROFILE_INSTRUCTIONS] / events[l][PROFILE_CYCLES]);
+        } else {
+            printf(" %6s\n", "n/a");
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <inttypes.h>
+
+#include "network.h"
+
+// Optional per-layer profiling of net_forward. While profiling is enabled,
+// every layer of every net_forward call is timed, and the time is added to
+// counters that belong to the calling thread, so threads never write to the
+// same cache line. While it is disabled (the default), net_forward only pays
+// for a single branch.
+//
+// Optionally, hardware performance counters are read around every layer as
+// well (with perf_event_open, counting the calling thread in user space only).
+// Every thread opens its own counters the first time it records anything. If
+// the kernel does not allow this (or the CPU lacks an event), the affected
+// counters are simply reported as unavailable.
+
+// The hardware events, in the order of the counters below.
+#define PROFILE_NUM_EVENTS 6
+#define PROFILE_CYCLES 0
+#define PROFILE_INSTRUCTIONS 1
+#define PROFILE_L1D_MISSES 2
+#define PROFILE_LLC_MISSES 3
+#define PROFILE_BRANCH_MISSES 4
+#define PROFILE_FP_INSTRUCTIONS 5
+
+// Per-thread counters, one entry per layer.
+typedef struct profile_counters {
+    uint64_t ns[NUM_LAYERS];
+    uint64_t cycles[NUM_LAYERS];
+    long images[NUM_LAYERS];
+
+    // Hardware events (scaled if the counters had to be shared), the number
+    // of images they were counted for, and which events this thread could
+    // open.
+    double events[NUM_LAYERS][PROFILE_NUM_EVENTS];
+    long event_images[NUM_LAYERS];
+    int events_available[PROFILE_NUM_EVENTS];
+
+    // perf_event_open group of this thread (-1 if none), the file descriptor
+    // of every event and its position in the group (-1 if not opened).
+    int group_fd;
+    int event_fd[PROFILE_NUM_EVENTS];
+    int event_index[PROFILE_NUM_EVENTS];
+    int num_group_events;
+
+    struct profile_counters *next;
+} profile_counters_t;
+
+// A point in time, as returned by profile_start.
+typedef struct profile_stamp {
+    uint64_t ns;
+    uint64_t cycles;
+
+    // Raw values of the hardware event group (if it was read), followed by the
+    // times the group was enabled and running.
+    int has_events;
+    uint64_t events[PROFILE_NUM_EVENTS];
+    uint64_t enabled;
+    uint64_t running;
+} profile_stamp_t;
+
+// Nonzero while profiling is enabled (read only, see profile_enable).
+extern int profile_enabled;
+
+// Turns profiling on or off, and with it the hardware counters (if
+// hardware_counters is nonzero).
+void profile_enable(int enabled, int hardware_counters);
+
+// Clears the counters of all threads.
+void profile_reset(void);
+
+// Returns the current time, for profile_stop.
+profile_stamp_t profile_start(void);
+
+// Adds the time since start to the counters of layer on the calling thread,
+// for a call that processed the given number of images. Called around every
+// layer by instrument_forward while profiling is enabled.
+void profile_stop(int layer, profile_stamp_t start, int images);
+
+// Prints a table with the time of every layer (summed over all threads), its
+// share of the total, the cycles per image, the achieved GFLOP/s per thread
+// and the bytes the layer has to move at least (its input, output and
+// weights), computed from the shapes of the layers of net. With hardware
+// counters, a second table shows the events of every layer.
+void profile_report(network_t *net);
+
+#endif
@@ -0,0 +1,345 @@
+// Needed for Unix domain sockets, MSG_NOSIGNAL, clock_gettime and lstat.
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Include OpenMP
+#include <omp.h>
+
+#include "instrument.h"
+#include "latency.h"
+#include "network.h"
+#include "server.h"
+#include "volume.h"
+
+// Reads exactly size bytes. Returns 0 if the connection ends first.
+static int read_full(int fd, void *buffer, size_t size) {
+    char *p = (char *) buffer;
+    while (size > 0) {
+        ssize_t got = read(fd, p, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return 0;
+        }
+        p += got;
+        size -= got;
+    }
+    return 1;
+}
+
+// Writes exactly size bytes. Returns 0 if the client went away.
+static int write_full(int fd, const void *buffer, size_t size) {
+    const char *p = (const char *) buffer;
+    while (size > 0) {
+        ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return 0;
+        }
+        p += sent;
+        size -= sent;
+    }
+    return 1;
+}
+
+// Set from a signal handler without holding the lock.
+static inline int is_stopping(server_t *s) {
+    return __atomic_load_n(&s->stopping, __ATOMIC_RELAXED);
+}
+
+static void *server_batcher(void *arg) {
+    server_t *s = (server_t *) arg;
+
+    batch_t *b = make_batch_view(s->net, s->max_batch);
+    server_request_t **batch = (server_request_t **) malloc(sizeof(server_request_t *) * s->max_batch);
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        // Even when stopping, a client may still queue a request it has
+        // already read, so only quit once all clients are gone.
+        while (s->queued == 0 && !(is_stopping(s) && s->clients == NULL)) {
+            pthread_cond_wait(&s->queue_ready, &s->lock);
+        }
+        if (s->queued == 0) {
+            break;
+        }
+
+        // Give more requests a chance to arrive, but never let the oldest one
+        // wait longer than max_wait_us.
+        struct timespec deadline = s->head->arrival;
+        deadline.tv_nsec += (long) s->max_wait_us * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (s->queued < s->max_batch && !is_stopping(s)) {
+            if (pthread_cond_timedwait(&s->queue_ready, &s->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        int size = 0;
+        while (size < s->max_batch && s->head != NULL) {
+            batch[size++] = s->head;
+            s->head = s->head->next;
+        }
+        if (s->head == NULL) {
+            s->tail = NULL;
+        }
+        s->queued -= size;
+        pthread_mutex_unlock(&s->lock);
+
+        uint64_t begin = instrument_flags ? instrument_now() : 0;
+        for (int j = 0; j < size; j++) {
+            bind_input(b, j, batch[j]->input);
+        }
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int j = 0; j < size; j++) {
+            net_forward(s->net, b, j, j);
+            for (int c = 0; c < NUM_CLASSES; c++) {
+                batch[j]->likelihoods[c] = b[NUM_LAYERS][j]->weights[c];
+            }
+        }
+        if (instrument_flags) {
+            instrument_pass(begin, LATENCY_BATCH, size);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        for (int j = 0; j < size; j++) {
+            batch[j]->done = 1;
+            pthread_cond_signal(batch[j]->done_cond);
+        }
+        s->requests += size;
+        s->batches++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    free(batch);
+    free_batch_view(b, s->max_batch);
+    return NULL;
+}
+
+static void *server_client(void *arg) {
+    server_client_t *c = (server_client_t *) arg;
+    server_t *s = c->server;
+
+    uint8_t data[SERVER_REQUEST_SIZE];
+    pthread_cond_t done_cond;
+    pthread_cond_init(&done_cond, NULL);
+
+    server_request_t request;
+    request.input = make_volume(s->net->layers[0]->width, s->net->layers[0]->height, s->net->layers[0]->depth, 0.0);
+    request.done_cond = &done_cond;
+
+    while (read_full(c->fd, data, SERVER_REQUEST_SIZE)) {
+        s->decode(request.input, data);
+
+        pthread_mutex_lock(&s->lock);
+        request.done = 0;
+        request.next = NULL;
+        clock_gettime(CLOCK_REALTIME, &request.arrival);
+        if (s->tail == NULL) {
+            s->head = &request;
+        } else {
+            s->tail->next = &request;
+        }
+        s->tail = &request;
+        s->queued++;
+        pthread_cond_signal(&s->queue_ready);
+        while (!request.done) {
+            pthread_cond_wait(&done_cond, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (!write_full(c->fd, request.likelihoods, sizeof(request.likelihoods))) {
+            break;
+        }
+    }
+
+    free_volume(request.input);
+    pthread_cond_destroy(&done_cond);
+    close(c->fd);
+
+    pthread_mutex_lock(&s->lock);
+    server_client_t **p = &s->clients;
+    while (*p != c) {
+        p = &(*p)->next;
+    }
+    *p = c->next;
+    if (s->clients == NULL) {
+        pthread_cond_broadcast(&s->clients_done);
+        pthread_cond_broadcast(&s->queue_ready);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    free(c);
+    return NULL;
+}
+
+// Time to wait before accepting again after accept failed for a reason other
+// than an interruption or an aborted connection.
+#define ACCEPT_BACKOFF_US 10000
+
+// Fills in the address of the socket at path.
+static void socket_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    assert(strlen(path) < sizeof(addr->sun_path));
+    strcpy(addr->sun_path, path);
+}
+
+server_t *make_server(network_t *net, const char *socket_path, int max_batch, int max_wait_us,
+        server_decode_t decode) {
+    assert(max_batch > 0 && max_wait_us >= 0);
+
+    struct sockaddr_un addr;
+    socket_address(&addr, socket_path);
+
+    // Only ever remove a stale socket: never a file that happens to be there,
+    // and never the socket of a server that is still running.
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return NULL;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        int err = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+        int connect_errno = errno;
+        close(fd);
+        if (err == 0 || connect_errno != ECONNREFUSED) {
+            errno = EADDRINUSE;
+            return NULL;
+        }
+        unlink(socket_path);
+    }
+
+    server_t *s = (server_t *) malloc(sizeof(server_t));
+    s->net = net;
+    s->decode = decode;
+    s->max_batch = max_batch;
+    s->max_wait_us = max_wait_us;
+    s->socket_path = socket_path;
+    s->stopping = 0;
+
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(s->listen_fd >= 0);
+    int err = bind(s->listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+    assert(err == 0);
+    err = lstat(socket_path, &st);
+    assert(err == 0);
+    s->socket_dev = st.st_dev;
+    s->socket_ino = st.st_ino;
+    err = listen(s->listen_fd, 128);
+    assert(err == 0);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->queue_ready, NULL);
+    pthread_cond_init(&s->clients_done, NULL);
+    s->head = NULL;
+    s->tail = NULL;
+    s->queued = 0;
+    s->clients = NULL;
+    s->requests = 0;
+    s->batches = 0;
+
+    return s;
+}
+
+void server_run(server_t *s) {
+    int err = pthread_create(&s->batcher, NULL, server_batcher, s);
+    assert(err == 0);
+
+    while (!is_stopping(s)) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            // Errors like EMFILE or ENOMEM do not go away by retrying at
+            // once, so give the system a moment before the next attempt.
+            if (errno != EINTR && errno != ECONNABORTED) {
+                struct timespec backoff = {0, ACCEPT_BACKOFF_US * 1000};
+                nanosleep(&backoff, NULL);
+            }
+            continue;
+        }
+
+        server_client_t *c = (server_client_t *) malloc(sizeof(server_client_t));
+        c->server = s;
+        c->fd = fd;
+
+        pthread_mutex_lock(&s->lock);
+        c->next = s->clients;
+        s->clients = c;
+        pthread_mutex_unlock(&s->lock);
+
+        pthread_t thread;
+        err = pthread_create(&thread, NULL, server_client, c);
+        assert(err == 0);
+        pthread_detach(thread);
+    }
+
+    // Stop reading new requests. Requests that are already queued are still
+    // answered before the clients are disconnected.
+    pthread_mutex_lock(&s->lock);
+    for (server_client_t *c = s->clients; c != NULL; c = c->next) {
+        shutdown(c->fd, SHUT_RD);
+    }
+    pthread_cond_broadcast(&s->queue_ready);
+    while (s->clients != NULL) {
+        pthread_cond_wait(&s->clients_done, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->batcher, NULL);
+}
+
+void server_stop(server_t *s) {
+    __atomic_store_n(&s->stopping, 1, __ATOMIC_RELAXED);
+    shutdown(s->listen_fd, SHUT_RDWR);
+}
+
+void free_server(server_t *s) {
+    close(s->listen_fd);
+
+    // Another server may have taken over the path after this one stopped.
+    struct stat st;
+    if (lstat(s->socket_path, &st) == 0 && st.st_dev == s->socket_dev && st.st_ino == s->socket_ino) {
+        unlink(s->socket_path);
+    }
+
+    pthread_cond_destroy(&s->clients_done);
+    pthread_cond_destroy(&s->queue_ready);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+int server_connect(const char *socket_path) {
+    struct sockaddr_un addr;
+    socket_address(&addr, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_request(int fd, const uint8_t *data, double *likelihoods) {
+    return write_full(fd, data, SERVER_REQUEST_SIZE) &&
+           read_full(fd, likelihoods, sizeof(double) * NUM_CLASSES);
+}
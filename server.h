@@ -0,0 +1,102 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "network.h"
+#include "volume.h"
+
+// A local inference server. Clients connect to a Unix domain socket and send
+// images, one request at a time per connection. Every request is a raw
+// SERVER_REQUEST_SIZE byte image as stored in the cifar10 files, and the
+// answer is the NUM_CLASSES likelihoods as doubles (in the byte order of the
+// machine, since client and server share it).
+//
+// Requests of all connections are collected in one queue and classified
+// together in micro-batches: a batch is started as soon as max_batch requests
+// are waiting, or once the oldest waiting request has waited max_wait_us.
+
+// A cifar10 record: a label byte (ignored) followed by the R, G and B planes.
+#define SERVER_REQUEST_SIZE 3073
+
+// Converts a request into an input volume of the network.
+typedef void (*server_decode_t)(volume_t *v, const uint8_t *data);
+
+typedef struct server_request {
+    volume_t *input;
+    double likelihoods[NUM_CLASSES];
+    struct timespec arrival;
+    int done;
+    pthread_cond_t *done_cond;
+    struct server_request *next;
+} server_request_t;
+
+// A connected client, served by its own thread.
+typedef struct server_client {
+    struct server *server;
+    int fd;
+    struct server_client *next;
+} server_client_t;
+
+typedef struct server {
+    network_t *net;
+    server_decode_t decode;
+    int max_batch;
+    int max_wait_us;
+    const char *socket_path;
+    int listen_fd;
+    int stopping;
+
+    // The socket file this server created, so that free_server only removes
+    // it if nobody has replaced it since.
+    dev_t socket_dev;
+    ino_t socket_ino;
+
+    // Protects everything below.
+    pthread_mutex_t lock;
+    pthread_cond_t queue_ready;
+    pthread_cond_t clients_done;
+
+    server_request_t *head;
+    server_request_t *tail;
+    int queued;
+    server_client_t *clients;
+
+    pthread_t batcher;
+
+    // Statistics, for the report when the server stops.
+    long requests;
+    long batches;
+} server_t;
+
+// Creates a server for net listening on socket_path. A stale socket left
+// behind at that path (one that refuses connections) is replaced. Otherwise
+// the path is left alone and NULL is returned, with errno set to EADDRINUSE
+// if another server is listening on it, or EEXIST if it is not a socket. The
+// network has to outlive the server.
+server_t *make_server(network_t *net, const char *socket_path, int max_batch, int max_wait_us,
+        server_decode_t decode);
+
+// Serves clients until server_stop is called, then finishes all pending
+// requests, disconnects the clients and returns.
+void server_run(server_t *s);
+
+// Makes server_run return. Only sets a flag and shuts down the listening
+// socket, so it can be called from a signal handler.
+void server_stop(server_t *s);
+
+// Frees a server after server_run has returned, and removes its socket.
+void free_server(server_t *s);
+
+// Client side: connects to the server at socket_path. Returns the connected
+// socket, or -1 if there is no server.
+int server_connect(const char *socket_path);
+
+// Client side: sends one request and waits for its NUM_CLASSES likelihoods.
+// Returns 0 if the connection was closed.
+int server_request(int fd, const uint8_t *data, double *likelihoods);
+
+#endif
@@ -0,0 +1,381 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Include OpenMP
+#include <omp.h>
+
+#include "affinity.h"
+#include "network.h"
+#include "session.h"
+#include "volume.h"
+
+// Copies the weights of a network from a thread pinned to a CPU of the target
+// node, so that the copy is first touched (and thus allocated) on that node.
+typedef struct replica_request {
+    network_t *net;
+    network_t *copy;
+    int cpu;
+} replica_request_t;
+
+static void *make_replica(void *arg) {
+    replica_request_t *r = (replica_request_t *) arg;
+    pin_to_cpu(r->cpu);
+    r->copy = copy_network(r->net);
+    return NULL;
+}
+
+// Copies one node's range of the images of a job from a thread pinned to a CPU
+// of that node, so that the copies are first touched on that node.
+typedef struct input_request {
+    session_job_t *job;
+    volume_t **input;
+    int node;
+    int cpu;
+} input_request_t;
+
+static void *make_local_input(void *arg) {
+    input_request_t *r = (input_request_t *) arg;
+    session_job_t *job = r->job;
+    pin_to_cpu(r->cpu);
+
+    int start = job->next[r->node], end = job->end[r->node];
+    volume_t *first = r->input[start];
+    int size = first->width * first->height * first->depth;
+    double *data = (double *) malloc(sizeof(double) * size * (end - start));
+    for (int i = start; i < end; i++) {
+        volume_t *v = r->input[i];
+        assert(v->width * v->height * v->depth == size);
+        double *copy = data + (long) (i - start) * size;
+        memcpy(copy, v->weights, sizeof(double) * size);
+        job->local_input[i] = make_volume_view(v->width, v->height, v->depth, copy);
+    }
+    job->local_data[r->node] = data;
+    return NULL;
+}
+
+// Replaces the input of a job with node-local copies of its ranges. The nodes
+// are copied concurrently.
+static void localize_input(session_t *s, session_job_t *job) {
+    job->local_input = (volume_t **) malloc(sizeof(volume_t *) * job->n);
+    job->local_data = (double **) calloc(s->num_nodes, sizeof(double *));
+
+    input_request_t *requests = (input_request_t *) malloc(sizeof(input_request_t) * s->num_nodes);
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * s->num_nodes);
+    int *started = (int *) calloc(s->num_nodes, sizeof(int));
+    for (int node = 0; node < s->num_nodes; node++) {
+        if (job->next[node] == job->end[node]) {
+            continue;
+        }
+        // Nodes without workers have empty ranges, so there is a worker.
+        int t = 0;
+        while (s->workers[t].node != node) {
+            t++;
+        }
+        input_request_t r = {job, job->input, node, s->workers[t].cpu};
+        requests[node] = r;
+        int err = pthread_create(&threads[node], NULL, make_local_input, &requests[node]);
+        assert(err == 0);
+        started[node] = 1;
+    }
+    for (int node = 0; node < s->num_nodes; node++) {
+        if (started[node]) {
+            pthread_join(threads[node], NULL);
+        }
+    }
+    free(started);
+    free(threads);
+    free(requests);
+
+    job->input = job->local_input;
+}
+
+// Returns the oldest job that still has images to hand out, if any.
+static session_job_t *next_job(session_t *s) {
+    for (session_job_t *job = s->head; job != NULL; job = job->next_job) {
+        if (!job->exhausted) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void free_job(session_t *s, session_job_t *job) {
+    if (job->local_input != NULL) {
+        for (int i = 0; i < job->n; i++) {
+            free_volume_view(job->local_input[i]);
+        }
+        for (int node = 0; node < s->num_nodes; node++) {
+            free(job->local_data[node]);
+        }
+        free(job->local_input);
+        free(job->local_data);
+    }
+    free(job->next);
+    free(job->end);
+    free(job);
+}
+
+// Runs the callback of a job whose results are all written, removes it from
+// the queue and wakes up whoever waits for it. Called with the lock held.
+static void finish_job(session_t *s, session_job_t *job) {
+    // The job stays queued (but exhausted) while the callback runs, so that
+    // session_wait does not return before the callback is done.
+    if (job->callback != NULL) {
+        pthread_mutex_unlock(&s->lock);
+        job->callback(job->ctx);
+        pthread_mutex_lock(&s->lock);
+    }
+
+    session_job_t **p = &s->head;
+    session_job_t *last = NULL;
+    while (*p != job) {
+        last = *p;
+        p = &(*p)->next_job;
+    }
+    *p = job->next_job;
+    if (s->tail == job) {
+        s->tail = last;
+    }
+
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&s->work_done);
+    if (job->detached) {
+        free_job(s, job);
+    }
+}
+
+static void *session_worker(void *arg) {
+    session_worker_t *w = (session_worker_t *) arg;
+    session_t *s = w->session;
+
+    pin_to_cpu(w->cpu);
+
+    // Allocated by the worker itself, after pinning, so that the memory is
+    // first touched on the worker's own node.
+    batch_t *b = make_batch_view(s->net, 1);
+    network_t *net = s->replicas[w->node];
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        session_job_t *job = next_job(s);
+        while (job == NULL && !s->shutdown) {
+            pthread_cond_wait(&s->work_ready, &s->lock);
+            job = next_job(s);
+        }
+        if (job == NULL) {
+            break;
+        }
+
+        job->active++;
+        pthread_mutex_unlock(&s->lock);
+
+        // Starting with the worker's own node, take images from one node's
+        // range until it is empty, then move on to the next node.
+        int done = 0;
+        for (int k = 0; k < s->num_nodes; k++) {
+            int node = (w->node + k) % s->num_nodes;
+            while (1) {
+                int start = __atomic_fetch_add(&job->next[node], s->chunk_size, __ATOMIC_RELAXED);
+                if (start >= job->end[node]) {
+                    break;
+                }
+                int end = start + s->chunk_size < job->end[node] ? start + s->chunk_size : job->end[node];
+                for (int i = start; i < end; i++) {
+                    bind_input(b, 0, job->input[i]);
+                    net_forward(net, b, 0, 0);
+                    net_store_output(job->out, i, b[11][0]->weights);
+                }
+                done += end - start;
+            }
+        }
+
+        // Every image of the job has been handed out by now. Whoever is the
+        // last one to leave the job once all of its images are done finishes
+        // it.
+        pthread_mutex_lock(&s->lock);
+        job->exhausted = 1;
+        job->completed += done;
+        job->active--;
+        if (job->completed == job->n && job->active == 0) {
+            finish_job(s, job);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    free_batch_view(b, 1);
+    return NULL;
+}
+
+session_t *make_session(network_t *net, int num_threads) {
+    session_t *s = (session_t *) malloc(sizeof(session_t));
+
+    s->net = net;
+    s->num_threads = num_threads > 0 ? num_threads : omp_get_max_threads();
+    // Requests are small, so hand out single images for the best balance.
+    s->chunk_size = 1;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work_ready, NULL);
+    pthread_cond_init(&s->work_done, NULL);
+
+    s->num_nodes = num_numa_nodes();
+    s->replicas = (network_t **) malloc(sizeof(network_t *) * s->num_nodes);
+    s->node_threads = (int *) calloc(s->num_nodes, sizeof(int));
+
+    s->head = NULL;
+    s->tail = NULL;
+    s->shutdown = 0;
+
+    s->workers = (session_worker_t *) malloc(sizeof(session_worker_t) * s->num_threads);
+    for (int t = 0; t < s->num_threads; t++) {
+        s->workers[t].session = s;
+        s->workers[t].cpu = allowed_cpu(t);
+        s->workers[t].node = cpu_node(s->workers[t].cpu);
+        s->node_threads[s->workers[t].node]++;
+    }
+
+    // Replicate the weights on every node that has workers. With a single
+    // node, the workers simply share the original network.
+    for (int node = 0; node < s->num_nodes; node++) {
+        s->replicas[node] = net;
+    }
+    if (s->num_nodes > 1) {
+        for (int node = 0; node < s->num_nodes; node++) {
+            for (int t = 0; t < s->num_threads; t++) {
+                if (s->workers[t].node == node) {
+                    replica_request_t r = {net, NULL, s->workers[t].cpu};
+                    pthread_t thread;
+                    int err = pthread_create(&thread, NULL, make_replica, &r);
+                    assert(err == 0);
+                    pthread_join(thread, NULL);
+                    s->replicas[node] = r.copy;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < s->num_threads; t++) {
+        int err = pthread_create(&s->workers[t].thread, NULL, session_worker, &s->workers[t]);
+        assert(err == 0);
+    }
+
+    return s;
+}
+
+void free_session(session_t *s) {
+    session_wait(s);
+
+    pthread_mutex_lock(&s->lock);
+    s->shutdown = 1;
+    pthread_cond_broadcast(&s->work_ready);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int t = 0; t < s->num_threads; t++) {
+        pthread_join(s->workers[t].thread, NULL);
+    }
+
+    for (int node = 0; node < s->num_nodes; node++) {
+        if (s->replicas[node] != s->net) {
+            free_network(s->replicas[node]);
+        }
+    }
+
+    pthread_cond_destroy(&s->work_done);
+    pthread_cond_destroy(&s->work_ready);
+    pthread_mutex_destroy(&s->lock);
+    free(s->node_threads);
+    free(s->replicas);
+    free(s->workers);
+    free(s);
+}
+
+session_job_t *session_submit_async(session_t *s, volume_t **input, net_output_t *out, int n,
+        session_callback_t callback, void *ctx) {
+    assert(out->mode != NET_OUTPUT_TOP_K || (out->k > 0 && out->k <= NUM_CLASSES));
+    assert(n >= 0);
+
+    session_job_t *job = (session_job_t *) malloc(sizeof(session_job_t));
+    job->input = input;
+    job->out = out;
+    job->n = n;
+    job->callback = callback;
+    job->ctx = ctx;
+    job->completed = 0;
+    job->active = 0;
+    job->exhausted = 0;
+    job->done = 0;
+    job->detached = 0;
+    job->next_job = NULL;
+    job->local_input = NULL;
+    job->local_data = NULL;
+
+    // Split the images into contiguous ranges, one per node, sized by the
+    // number of workers on the node.
+    job->next = (int *) malloc(sizeof(int) * s->num_nodes);
+    job->end = (int *) malloc(sizeof(int) * s->num_nodes);
+    int start = 0, threads = 0;
+    for (int node = 0; node < s->num_nodes; node++) {
+        threads += s->node_threads[node];
+        int end = (int) ((long) n * threads / s->num_threads);
+        job->next[node] = start;
+        job->end[node] = end;
+        start = end;
+    }
+    if (s->num_nodes > 1 && n > 0) {
+        localize_input(s, job);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (s->tail == NULL) {
+        s->head = job;
+    } else {
+        s->tail->next_job = job;
+    }
+    s->tail = job;
+
+    // Even an empty job is handed to the workers, so that its callback runs on
+    // a worker thread like every other one.
+    pthread_cond_broadcast(&s->work_ready);
+    pthread_mutex_unlock(&s->lock);
+
+    return job;
+}
+
+int session_poll(session_t *s, session_job_t *job) {
+    return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+}
+
+void session_wait_job(session_t *s, session_job_t *job) {
+    pthread_mutex_lock(&s->lock);
+    while (!job->done) {
+        pthread_cond_wait(&s->work_done, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    free_job(s, job);
+}
+
+void session_release(session_t *s, session_job_t *job) {
+    pthread_mutex_lock(&s->lock);
+    if (job->done) {
+        free_job(s, job);
+    } else {
+        job->detached = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void session_submit(session_t *s, volume_t **input, net_output_t *out, int n) {
+    session_release(s, session_submit_async(s, input, out, n, NULL, NULL));
+}
+
+void session_wait(session_t *s) {
+    pthread_mutex_lock(&s->lock);
+    while (s->head != NULL) {
+        pthread_cond_wait(&s->work_done, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,123 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+
+#include "network.h"
+#include "volume.h"
+
+// A session is a long-lived wrapper around a network for workloads that make
+// many (small) classification calls. It owns a pool of worker threads, each
+// pinned to its own CPU and each with its own preallocated batch, so a call
+// pays neither for starting threads nor for allocating activations.
+//
+// On machines with several NUMA nodes, every node gets its own copy of the
+// weights, and the activations of a worker are allocated on the worker's node.
+// The images of a submission are split into one contiguous range per node
+// (sized by the number of workers on it), and every range is copied into
+// memory of its node (by a thread on that node) before the workers start, so
+// the inputs are local as well. Workers classify the images of their own node
+// first. Only once those are done do they help other nodes.
+
+// Called on a worker thread once all results of a job have been written.
+typedef void (*session_callback_t)(void *ctx);
+
+// A single submission: n input images and where to write their results.
+// Submissions are queued and classified in order, but a worker that finds no
+// more images to claim in one job moves on to the next job right away, so
+// consecutive jobs overlap instead of waiting for each other.
+typedef struct session_job {
+    volume_t **input;
+    net_output_t *out;
+    int n;
+
+    session_callback_t callback;
+    void *ctx;
+
+    // Per node: next image to hand out and the end of the node's range.
+    int *next;
+    int *end;
+
+    // With several nodes, input points to copies of the submitted images
+    // (views into one buffer per node, allocated on that node). NULL with a
+    // single node.
+    volume_t **local_input;
+    double **local_data;
+
+    // Number of images finished so far.
+    int completed;
+
+    // Number of workers that are currently working on this job.
+    int active;
+
+    // Set once every image has been handed out, once the results (and the
+    // callback) are done, and when nobody is going to wait for the job.
+    int exhausted;
+    int done;
+    int detached;
+
+    struct session_job *next_job;
+} session_job_t;
+
+// Per-thread state of a worker.
+typedef struct session_worker {
+    struct session *session;
+    pthread_t thread;
+    int cpu;
+    int node;
+} session_worker_t;
+
+typedef struct session {
+    network_t *net;
+    int num_threads;
+    int chunk_size;
+    session_worker_t *workers;
+
+    // One copy of the network per NUMA node (all pointing to net if there is
+    // only one node), and the number of workers on every node.
+    int num_nodes;
+    network_t **replicas;
+    int *node_threads;
+
+    // Protects everything below.
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+
+    // Jobs that are not finished yet, oldest first.
+    session_job_t *head;
+    session_job_t *tail;
+    int shutdown;
+} session_t;
+
+// Creates a session for net with num_threads workers (the OpenMP default if
+// num_threads is 0 or less). The network has to outlive the session.
+session_t *make_session(network_t *net, int num_threads);
+
+// Waits for all submitted jobs, then stops the workers.
+void free_session(session_t *s);
+
+// Queues n images for classification and returns a handle for the job. The
+// results are written to out in the same way as net_classify_output, and then
+// callback (if not NULL) is called with ctx. The handle stays valid until it
+// is passed to session_wait_job or session_release.
+session_job_t *session_submit_async(session_t *s, volume_t **input, net_output_t *out, int n,
+        session_callback_t callback, void *ctx);
+
+// Returns 1 if the job is done (including its callback), 0 otherwise.
+int session_poll(session_t *s, session_job_t *job);
+
+// Waits until the job is done and releases its handle.
+void session_wait_job(session_t *s, session_job_t *job);
+
+// Releases the handle of a job without waiting for it. The job still runs to
+// completion and its callback is still called.
+void session_release(session_t *s, session_job_t *job);
+
+// Queues n images like session_submit_async, but without a handle.
+void session_submit(session_t *s, volume_t **input, net_output_t *out, int n);
+
+// Waits until all submitted jobs are done.
+void session_wait(session_t *s);
+
+#endif
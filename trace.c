@@ -0,0 +1,130 @@
+// Needed for posix_memalign.
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "instrument.h"
+#include "trace.h"
+
+int trace_enabled = 0;
+
+static const char *trace_file = NULL;
+static int buffer_size = TRACE_DEFAULT_EVENTS;
+static uint64_t trace_start = 0;
+
+// Ring buffer of one thread. Events are written to events[count % size].
+typedef struct trace_buffer {
+    uint64_t count;
+    int tid;
+    trace_event_t *events;
+    struct trace_buffer *next;
+} trace_buffer_t;
+
+// The buffers of all threads that have ever recorded anything. They are kept
+// after the thread exits, so they can still be written.
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *all_buffers = NULL;
+static int num_buffers = 0;
+static __thread trace_buffer_t *thread_buffer = NULL;
+
+static trace_buffer_t *local_buffer(void) {
+    if (thread_buffer == NULL) {
+        trace_buffer_t *b = (trace_buffer_t *) malloc(sizeof(trace_buffer_t));
+        void *memory;
+        if (posix_memalign(&memory, 64, sizeof(trace_event_t) * buffer_size) != 0) {
+            abort();
+        }
+        b->events = (trace_event_t *) memory;
+        b->count = 0;
+
+        pthread_mutex_lock(&buffers_lock);
+        b->tid = num_buffers++;
+        b->next = all_buffers;
+        all_buffers = b;
+        pthread_mutex_unlock(&buffers_lock);
+
+        thread_buffer = b;
+    }
+    return thread_buffer;
+}
+
+void trace_enable(const char *file_name, int events_per_thread) {
+    if (trace_enabled) {
+        return;
+    }
+
+    buffer_size = 1;
+    while (buffer_size < events_per_thread) {
+        buffer_size *= 2;
+    }
+    trace_file = file_name;
+    trace_start = instrument_now();
+    trace_enabled = 1;
+    instrument_set(INSTRUMENT_TRACE, 1);
+    atexit(trace_dump);
+}
+
+uint64_t trace_now(void) {
+    return trace_enabled ? instrument_now() : 0;
+}
+
+void trace_record(const char *name, const char *category, uint64_t start_ns, int images) {
+    if (start_ns == 0) {
+        return;
+    }
+
+    uint64_t end_ns = instrument_now();
+    trace_buffer_t *b = local_buffer();
+    trace_event_t *e = &b->events[b->count & (buffer_size - 1)];
+    e->name = name;
+    e->category = category;
+    e->start_ns = start_ns;
+    e->duration_ns = end_ns - start_ns;
+    e->images = images;
+    b->count++;
+}
+
+void trace_dump(void) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_enabled = 0;
+    instrument_set(INSTRUMENT_TRACE, 0);
+
+    FILE *fout = fopen(trace_file, "w");
+    if (fout == NULL) {
+        fprintf(stderr, "Cannot write the trace to %s\n", trace_file);
+        return;
+    }
+
+    int pid = (int) getpid();
+    uint64_t dropped = 0;
+    fprintf(fout, "{\"traceEvents\": [\n");
+    pthread_mutex_lock(&buffers_lock);
+    for (trace_buffer_t *b = all_buffers; b != NULL; b = b->next) {
+        fprintf(fout, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"thread %d\"}},\n", pid, b->tid, b->tid);
+
+        uint64_t first = b->count > (uint64_t) buffer_size ? b->count - buffer_size : 0;
+        dropped += first;
+        for (uint64_t i = first; i < b->count; i++) {
+            trace_event_t *e = &b->events[i & (buffer_size - 1)];
+            // Timestamps are in microseconds since tracing started.
+            fprintf(fout, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"pid\": %d, \"tid\": %d, \"args\": {\"images\": %d}},\n", e->name, e->category,
+                    (e->start_ns - trace_start) * 1e-3, e->duration_ns * 1e-3, pid, b->tid, e->images);
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    // The metadata event closes the list, so the last event above can keep
+    // its comma.
+    fprintf(fout, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"args\": {\"name\": \"benchmark\", \"dropped_events\": %lu}}\n", pid, dropped);
+    fprintf(fout, "]}\n");
+    fclose(fout);
+}
@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+
+// Optional timeline of net_forward and of the loaders, written in the Chrome
+// trace_event format (for Perfetto or chrome://tracing). While tracing is
+// enabled, every forward pass (one event per image, or per batch), every
+// layer within it and every file the loaders read is recorded as an event in
+// a ring buffer of the calling thread. Only that thread writes to its buffer,
+// so recording needs neither locks nor atomics. Once a buffer is full, its
+// oldest events are overwritten. All buffers are written out when the process
+// exits.
+
+#define TRACE_DEFAULT_EVENTS (1 << 16)
+
+typedef struct trace_event {
+    const char *name;
+    const char *category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    int images;
+} trace_event_t;
+
+// Nonzero while tracing is enabled (read only, see trace_enable).
+extern int trace_enabled;
+
+// Starts tracing. The trace is written to file_name at exit. Every thread
+// keeps the last events_per_thread events (rounded up to a power of two).
+void trace_enable(const char *file_name, int events_per_thread);
+
+// Returns the start time of an event for trace_record (0 while tracing is
+// disabled).
+uint64_t trace_now(void);
+
+// Records an event that started at start_ns and ends now, for the given
+// number of images (0 if it is not about images). The name and the category
+// are kept as pointers, so they have to be string literals. Ignored if
+// start_ns is 0.
+void trace_record(const char *name, const char *category, uint64_t start_ns, int images);
+
+// Writes the trace file (called at exit). Threads must not record events
+// while it runs.
+void trace_dump(void);
+
+#endif
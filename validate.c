@@ -0,0 +1,228 @@
+// Needed for stat and realpath.
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "parse.h"
+#include "validate.h"
+
+// Magic number at the start of a cache file.
+static const uint64_t CACHE_MAGIC = 0x3266657263666e63;
+
+static reference_t *make_reference(int num_records, long num_values) {
+    reference_t *ref = (reference_t *) malloc(sizeof(reference_t));
+    ref->num_records = num_records;
+    ref->tags = malloc(VALIDATE_TAG_SIZE * (num_records > 0 ? num_records : 1));
+    ref->offsets = (long *) malloc(sizeof(long) * (num_records + 1));
+    ref->values = (double *) malloc(sizeof(double) * (num_values > 0 ? num_values : 1));
+    return ref;
+}
+
+void free_reference(reference_t *ref) {
+    free(ref->tags);
+    free(ref->offsets);
+    free(ref->values);
+    free(ref);
+}
+
+reference_t *load_reference(const char *file_name) {
+    FILE *fin = fopen(file_name, "rb");
+    if (fin == NULL) {
+        return NULL;
+    }
+
+    fseek(fin, 0, SEEK_END);
+    long size = ftell(fin);
+    fseek(fin, 0, SEEK_SET);
+
+    char *text = malloc(size + 1);
+    assert(fread(text, 1, size, fin) == (size_t) size);
+    text[size] = '\0';
+    fclose(fin);
+
+    // Every number is preceded by a comma, so this bounds the sizes.
+    int num_lines = 0;
+    long num_commas = 0;
+    for (long i = 0; i < size; i++) {
+        num_lines += text[i] == '\n';
+        num_commas += text[i] == ',';
+    }
+    if (size > 0 && text[size - 1] != '\n') {
+        num_lines++;
+    }
+
+    reference_t *ref = make_reference(num_lines, num_commas);
+    long count = 0;
+    int r = 0;
+    const char *p = text;
+    while (*p != '\0') {
+        const char *tag = p;
+        while (*p != ',' && *p != '\n' && *p != '\0') {
+            p++;
+        }
+        int length = p - tag < VALIDATE_TAG_SIZE - 1 ? (int) (p - tag) : VALIDATE_TAG_SIZE - 1;
+        memcpy(ref->tags[r], tag, length);
+        ref->tags[r][length] = '\0';
+
+        ref->offsets[r] = count;
+        while (*p == ',') {
+            const char *end;
+            ref->values[count++] = parse_double(p + 1, &end);
+            assert(end != p + 1);
+            p = end;
+        }
+        while (*p == '\r' || *p == '\n') {
+            p++;
+        }
+        r++;
+    }
+    ref->num_records = r;
+    ref->offsets[r] = count;
+
+    free(text);
+    return ref;
+}
+
+// Layout of a cache file: the magic number, the device, inode, size and
+// modification time of the text file it was made from, the number of records
+// and of values, then the tags, the offsets and the values.
+#define CACHE_HEADER_SIZE 7
+
+static reference_t *read_cache(const char *cache_file, struct stat *text_stat) {
+    FILE *fin = fopen(cache_file, "rb");
+    if (fin == NULL) {
+        return NULL;
+    }
+
+    uint64_t header[CACHE_HEADER_SIZE];
+    if (fread(header, sizeof(uint64_t), CACHE_HEADER_SIZE, fin) != CACHE_HEADER_SIZE ||
+        header[0] != CACHE_MAGIC || header[1] != (uint64_t) text_stat->st_dev ||
+        header[2] != (uint64_t) text_stat->st_ino || header[3] != (uint64_t) text_stat->st_size ||
+        header[4] != (uint64_t) text_stat->st_mtime) {
+        fclose(fin);
+        return NULL;
+    }
+
+    uint64_t num_records = header[5], num_values = header[6];
+    reference_t *ref = make_reference((int) num_records, (long) num_values);
+    int ok = fread(ref->tags, VALIDATE_TAG_SIZE, num_records, fin) == num_records &&
+             fread(ref->offsets, sizeof(long), num_records + 1, fin) == num_records + 1 &&
+             fread(ref->values, sizeof(double), num_values, fin) == num_values;
+    fclose(fin);
+
+    if (!ok) {
+        free_reference(ref);
+        return NULL;
+    }
+    return ref;
+}
+
+static void write_cache(reference_t *ref, const char *cache_file, struct stat *text_stat) {
+    FILE *fout = fopen(cache_file, "wb");
+    if (fout == NULL) {
+        return;
+    }
+
+    uint64_t header[CACHE_HEADER_SIZE] = {CACHE_MAGIC, (uint64_t) text_stat->st_dev,
+                                          (uint64_t) text_stat->st_ino, (uint64_t) text_stat->st_size,
+                                          (uint64_t) text_stat->st_mtime, (uint64_t) ref->num_records,
+                                          (uint64_t) ref->offsets[ref->num_records]};
+    fwrite(header, sizeof(uint64_t), CACHE_HEADER_SIZE, fout);
+    fwrite(ref->tags, VALIDATE_TAG_SIZE, ref->num_records, fout);
+    fwrite(ref->offsets, sizeof(long), ref->num_records + 1, fout);
+    fwrite(ref->values, sizeof(double), ref->offsets[ref->num_records], fout);
+    fclose(fout);
+}
+
+reference_t *load_reference_cached(const char *file_name, const char *cache_dir) {
+    struct stat text_stat;
+    char path[PATH_MAX];
+    if (stat(file_name, &text_stat) != 0 || realpath(file_name, path) == NULL) {
+        return NULL;
+    }
+
+    // <cache_dir>/<base name>.<FNV-1a hash of the full path>.bin
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t) *c) * 0x100000001b3ULL;
+    }
+    const char *base = strrchr(path, '/') + 1;
+    char cache_file[PATH_MAX + 64];
+    snprintf(cache_file, sizeof(cache_file), "%s/%s.%016lx.bin", cache_dir, base, hash);
+
+    reference_t *ref = read_cache(cache_file, &text_stat);
+    if (ref != NULL) {
+        return ref;
+    }
+
+    ref = load_reference(file_name);
+    if (ref != NULL) {
+        write_cache(ref, cache_file, &text_stat);
+    }
+    return ref;
+}
+
+int find_record(reference_t *ref, const char *tag) {
+    for (int r = 0; r < ref->num_records; r++) {
+        if (!strcmp(ref->tags[r], tag)) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+// Maps the bits of a double to an integer that is ordered like the doubles
+// (with -0.0 and 0.0 both mapped to 0).
+static int64_t ordered_bits(double x) {
+    int64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits < 0 ? INT64_MIN - bits : bits;
+}
+
+uint64_t ulp_distance(double a, double b) {
+    int64_t x = ordered_bits(a);
+    int64_t y = ordered_bits(b);
+    return x > y ? (uint64_t) x - (uint64_t) y : (uint64_t) y - (uint64_t) x;
+}
+
+static int is_close(double a, double b) {
+    if (a == b) {
+        return 1;
+    }
+    double tolerance = VALIDATE_REL_TOL * fmax(fabs(a), fabs(b));
+    return fabs(a - b) <= fmax(tolerance, VALIDATE_ABS_TOL);
+}
+
+int compare_record(reference_t *ref, int r, const double *values, int n, const char *format, mismatch_t *m) {
+    const double *expected = ref->values + ref->offsets[r];
+    int count = (int) (ref->offsets[r + 1] - ref->offsets[r]);
+
+    m->record = r;
+    if (count != n) {
+        m->index = -1;
+        m->value = n;
+        m->expected = count;
+        m->ulps = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        char printed[512];
+        snprintf(printed, sizeof(printed), format, values[i]);
+        double value = strtod(printed, NULL);
+        if (!is_close(value, expected[i])) {
+            m->index = i;
+            m->value = value;
+            m->expected = expected[i];
+            m->ulps = ulp_distance(value, expected[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
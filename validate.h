@@ -0,0 +1,64 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <inttypes.h>
+
+// In-process validation against the reference files in test/ref. A reference
+// file has one record per line: a tag (like LAYER3 or PAR17) followed by
+// comma-separated numbers. References are parsed once into a compact form
+// (all numbers in one array) and can be cached in a binary file, so later
+// runs do not parse the text again.
+//
+// Values are compared like test/compare_layers.py and test/compare_output.py
+// do: a computed value is first rounded the way it would have been printed
+// for those scripts, then compared with math.isclose semantics (relative
+// tolerance 1e-9, absolute tolerance 1e-10).
+
+#define VALIDATE_REL_TOL 1e-9
+#define VALIDATE_ABS_TOL 1e-10
+#define VALIDATE_TAG_SIZE 16
+
+typedef struct reference {
+    int num_records;
+    char (*tags)[VALIDATE_TAG_SIZE];
+
+    // The numbers of record r are values[offsets[r]] to
+    // values[offsets[r + 1] - 1].
+    long *offsets;
+    double *values;
+} reference_t;
+
+// The first value that does not match a reference.
+typedef struct mismatch {
+    int record;
+    int index;
+    double value;
+    double expected;
+    uint64_t ulps;
+} mismatch_t;
+
+// Parses a reference file. Returns NULL if it cannot be read.
+reference_t *load_reference(const char *file_name);
+
+// Like load_reference, but reads a binary cache in cache_dir instead if it was
+// made from the current version of file_name, and writes it otherwise. The
+// cache file is named after the full path of file_name, and remembers the
+// device, inode, size and modification time of the text file it was made from,
+// so references with the same name in different folders do not share it.
+reference_t *load_reference_cached(const char *file_name, const char *cache_dir);
+
+void free_reference(reference_t *ref);
+
+// Returns the index of the record with the given tag, or -1.
+int find_record(reference_t *ref, const char *tag);
+
+// Returns the number of representable doubles between a and b.
+uint64_t ulp_distance(double a, double b);
+
+// Compares the n values against record r of ref, after rounding every value
+// as printf would with format. Returns 1 if they all match. Otherwise returns
+// 0 and stores the first mismatch in *m (with index -1 if the number of
+// values differs).
+int compare_record(reference_t *ref, int r, const double *values, int n, const char *format, mismatch_t *m);
+
+#endif
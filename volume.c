@@ -13,6 +13,7 @@
 // Include OpenMP
 #include <omp.h>
 
+#include "memtrack.h"
 #include "volume.h"
 
 inline double volume_get(volume_t *v, int x, int y, int d) {
@@ -24,6 +25,10 @@ inline void volume_set(volume_t *v, int x, int y, int d, double value) {
 }
 
 volume_t *make_volume(int width, int height, int depth, double value) {
+    return make_volume_in(width, height, depth, value, MEM_OTHER);
+}
+
+volume_t *make_volume_in(int width, int height, int depth, double value, int category) {
     volume_t *new_vol = malloc(sizeof(struct volume));
     new_vol->weights = malloc(sizeof(double) * width * height * depth);
 
@@ -32,6 +37,8 @@ volume_t *make_volume(int width, int height, int depth, double value) {
     new_vol->width = width;
     new_vol->height = height;
     new_vol->depth = depth;
+    new_vol->category = category;
+    mem_add(category, (long) mem_volume_bytes(new_vol));
 
     for (int x = 0; x < width; x++) {
         for (int y = 0; y < height; y++) {
@@ -119,6 +126,21 @@ void copy_volume(volume_t *dest, volume_t *src) {
 }
 
 void free_volume(volume_t *v) {
+    mem_add(v->category, -(long) mem_volume_bytes(v));
     free(v->weights);
     free(v);
+}
+
+volume_t *make_volume_view(int width, int height, int depth, double *weights) {
+    volume_t *view = malloc(sizeof(struct volume));
+    view->width = width;
+    view->height = height;
+    view->depth = depth;
+    view->weights = weights;
+    view->category = MEM_UNTRACKED;
+    return view;
+}
+
+void free_volume_view(volume_t *v) {
+    free(v);
 }
\ No newline at end of file
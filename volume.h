@@ -19,6 +19,10 @@ typedef struct volume {
     int height;
     int depth;
     double *weights;
+
+    // What the volume counts towards in the memory accounting (see
+    // memtrack.h), MEM_UNTRACKED for views.
+    int category;
 } volume_t;
 
 // Gets the element in the volume at the coordinates (x, y, d).
@@ -31,10 +35,21 @@ void volume_set(volume_t *v, int x, int y, int d, double value);
 // specified value.
 volume_t *make_volume(int width, int height, int depth, double value);
 
+// Same as make_volume, but the volume counts towards category (one of the
+// MEM_ categories of memtrack.h) instead of MEM_OTHER.
+volume_t *make_volume_in(int width, int height, int depth, double value, int category);
+
 // Copies the contents of one volume into another.
 void copy_volume(volume_t *dest, volume_t *src);
 
 // Frees the weights array and the struct itself.
 void free_volume(volume_t *v);
 
+// Creates a volume that refers to an existing weights array (owned by the
+// caller) instead of allocating its own. Nothing is copied.
+volume_t *make_volume_view(int width, int height, int depth, double *weights);
+
+// Frees a volume created by make_volume_view, but not the weights it refers to.
+void free_volume_view(volume_t *v);
+
 #endif
\ No newline at end of file